@@ -0,0 +1,85 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef GTSAM_IMUFACTORCPIv1REFERENCE_H
+#define GTSAM_IMUFACTORCPIv1REFERENCE_H
+
+#include <gtsam/nonlinear/NonlinearFactor.h>
+
+#include "gtsam/ImuFactorCPIv1.h"
+#include "gtsam/JPLNavState.h"
+#include "gtsam/RotationXY.h"
+#include "utils/quat_ops.h"
+
+namespace gtsam {
+
+/**
+ * @brief Previous implementation of our ImuFactorCPIv1, only used to benchmark against.
+ *
+ * This has the same measurement and constructor, but evaluateError() is the version before the Jacobians were written
+ * directly into fixed-size blocks (i.e. it fills zeroed 15x3 temporaries and uses dynamic identity matrices).
+ * Do not use this in the estimator, see ImuFactorCPIv1 instead.
+ */
+class ImuFactorCPIv1Reference : public NoiseModelFactor3<JPLNavState, JPLNavState, RotationXY> {
+private:
+  Vector3 alpha;   ///< preintegration measurement due to position
+  Vector3 beta;    ///< preintegration measurement due to velocity
+  Vector4 q_KtoK1; ///< preintegration measurement due to rotation
+
+  Bias3 ba_lin; ///< original acceleration bias linerization point
+  Bias3 bg_lin; ///< original gyroscope bias linearization point
+
+  Eigen::Matrix3d J_q;     ///< jacobian of the preintegrated rotation in respect to the gyro bias correction
+  Eigen::Matrix3d J_beta;  ///<  jacobian of the preintegrated velocity in respect to the gyro bias correction
+  Eigen::Matrix3d J_alpha; ///<  jacobian of the preintegrated position in respect to the gyro bias correction
+
+  Eigen::Matrix3d H_beta;  ///<  jacobian of the preintegrated velocity in respect to the accelerometer bias correction
+  Eigen::Matrix3d H_alpha; ///<  jacobian of the preintegrated position in respect to the accelerometer bias correction
+
+  double deltatime;         ///< time in seconds that this measurement is over
+  double gravity_magnitude; ///< global gravity magnitude (should be the same for all measurements)
+
+public:
+  /// Construct from the two linking JPLNavStates, preingration measurement, and its covariance (same as ImuFactorCPIv1)
+  ImuFactorCPIv1Reference(Key state_i, Key state_j, Key rotxy, Eigen::Matrix<double, 15, 15> covariance, double deltatime, double grav_m,
+                          Vector3 alpha, Vector3 beta, Vector4 q_KtoK1, Bias3 ba_lin, Bias3 bg_lin, Eigen::Matrix3d J_q,
+                          Eigen::Matrix3d J_beta, Eigen::Matrix3d J_alpha, Eigen::Matrix3d H_beta, Eigen::Matrix3d H_alpha)
+      : NoiseModelFactor3<JPLNavState, JPLNavState, RotationXY>(noiseModel::Gaussian::Covariance(covariance), state_i, state_j, rotxy) {
+    this->alpha = alpha;
+    this->beta = beta;
+    this->q_KtoK1 = q_KtoK1;
+    this->ba_lin = ba_lin;
+    this->bg_lin = bg_lin;
+    this->J_q = J_q;
+    this->J_beta = J_beta;
+    this->J_alpha = J_alpha;
+    this->H_beta = H_beta;
+    this->H_alpha = H_alpha;
+    this->deltatime = deltatime;
+    this->gravity_magnitude = grav_m;
+  }
+
+  /// Error function. Given the current states, calculate the measurement error/residual
+  gtsam::Vector evaluateError(const JPLNavState &state_i, const JPLNavState &state_j, const RotationXY &gravity,
+                              boost::optional<Matrix &> H1 = boost::none, boost::optional<Matrix &> H2 = boost::none,
+                              boost::optional<Matrix &> H3 = boost::none) const;
+};
+
+} // namespace gtsam
+
+#endif /* GTSAM_IMUFACTORCPIv1REFERENCE_H */
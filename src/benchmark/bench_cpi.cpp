@@ -0,0 +1,145 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "benchmark/CpiV1Reference.h"
+#include "cpi/CpiV1.h"
+
+/**
+ * Micro-benchmark of CpiV1::feed_IMU() against the previous implementation (see CpiV1Reference).
+ *
+ * We generate a random IMU stream with a given angular velocity magnitude and preintegrate it in windows.
+ * Each window is integrated by both kernels, and we report the time per sample along with the largest
+ * relative difference of every output (means, bias Jacobians, and measurement covariance).
+ *
+ * Usage: bench_cpi [num_samples] [window_sec]
+ */
+
+// Our IMU noises and rate (close to what we see on real datasets)
+static const double SIGMA_W = 1.6968e-04;
+static const double SIGMA_WB = 1.9393e-05;
+static const double SIGMA_A = 2.0000e-3;
+static const double SIGMA_AB = 3.0000e-3;
+static const double IMU_RATE = 200.0;
+
+/// Single IMU reading
+struct ImuSample {
+  double t;
+  Eigen::Vector3d wm;
+  Eigen::Vector3d am;
+};
+
+/// Largest difference between two matrices, relative to the largest value of the first
+template <typename Derived1, typename Derived2>
+double rel_diff(const Eigen::MatrixBase<Derived1> &a, const Eigen::MatrixBase<Derived2> &b) {
+  double scale = std::max(a.cwiseAbs().maxCoeff(), 1e-12);
+  return (a - b).cwiseAbs().maxCoeff() / scale;
+}
+
+/// Largest relative difference over all outputs of two preintegrations
+double max_rel_diff(const CpiBase &a, const CpiBase &b) {
+  double diff = std::abs(a.DT - b.DT) / std::max(std::abs(a.DT), 1e-12);
+  diff = std::max(diff, rel_diff(a.alpha_tau, b.alpha_tau));
+  diff = std::max(diff, rel_diff(a.beta_tau, b.beta_tau));
+  diff = std::max(diff, rel_diff(a.R_k2tau, b.R_k2tau));
+  diff = std::max(diff, rel_diff(a.J_q, b.J_q));
+  diff = std::max(diff, rel_diff(a.J_a, b.J_a));
+  diff = std::max(diff, rel_diff(a.J_b, b.J_b));
+  diff = std::max(diff, rel_diff(a.H_a, b.H_a));
+  diff = std::max(diff, rel_diff(a.H_b, b.H_b));
+  diff = std::max(diff, rel_diff(a.P_meas, b.P_meas));
+  return diff;
+}
+
+/// Preintegrates the samples in windows of the given length, and returns the total seconds it took
+template <typename Cpi>
+double integrate(const std::vector<ImuSample> &samples, size_t window, std::vector<Cpi, Eigen::aligned_allocator<Cpi>> &results) {
+  results.clear();
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i + 1 < samples.size(); i += window) {
+    Cpi cpi(SIGMA_W, SIGMA_WB, SIGMA_A, SIGMA_AB, true);
+    cpi.setLinearizationPoints(Eigen::Vector3d(1e-3, -2e-3, 5e-4), Eigen::Vector3d(0.05, -0.02, 0.01));
+    size_t end = std::min(i + window, samples.size() - 1);
+    for (size_t k = i; k < end; k++) {
+      cpi.feed_IMU(samples.at(k).t, samples.at(k + 1).t, samples.at(k).wm, samples.at(k).am, samples.at(k + 1).wm, samples.at(k + 1).am);
+    }
+    results.push_back(cpi);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(t1 - t0).count();
+}
+
+int main(int argc, char **argv) {
+
+  // Parameters
+  size_t num_samples = (argc > 1) ? (size_t)std::atol(argv[1]) : 200000;
+  double window_sec = (argc > 2) ? std::atof(argv[2]) : 1.0;
+  size_t window = std::max((size_t)1, (size_t)std::round(window_sec * IMU_RATE));
+  const double tolerance = 1e-10;
+  printf("[BENCH]: %zu samples at %.0f hz, %.2f sec windows\n", num_samples, IMU_RATE, window_sec);
+
+  // Run for a slow, medium, and fast rotation (the slow one hits the small angle branches)
+  bool success = true;
+  std::mt19937 gen(42);
+  std::normal_distribution<double> noise(0.0, 1.0);
+  for (double mag_w : {0.001, 0.5, 2.0}) {
+
+    // Generate the IMU readings, the rotation axis slowly changes over time
+    std::vector<ImuSample> samples(num_samples);
+    for (size_t i = 0; i < num_samples; i++) {
+      double t = (double)i / IMU_RATE;
+      Eigen::Vector3d axis(std::sin(0.3 * t), std::cos(0.2 * t), 0.5);
+      samples.at(i).t = t;
+      samples.at(i).wm = mag_w * axis.normalized() + 1e-3 * Eigen::Vector3d(noise(gen), noise(gen), noise(gen));
+      samples.at(i).am =
+          Eigen::Vector3d(0.3 * std::sin(t), 0.2 * std::cos(t), 9.81) + 0.05 * Eigen::Vector3d(noise(gen), noise(gen), noise(gen));
+    }
+
+    // Integrate with both (the old kernel first so both run on a warm cache)
+    std::vector<CpiV1Reference, Eigen::aligned_allocator<CpiV1Reference>> results_old;
+    std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> results_new;
+    integrate(samples, window, results_old);
+    double time_old = integrate(samples, window, results_old);
+    double time_new = integrate(samples, window, results_new);
+
+    // Compare every output
+    double diff = 0.0;
+    for (size_t i = 0; i < results_old.size(); i++) {
+      diff = std::max(diff, max_rel_diff(results_old.at(i), results_new.at(i)));
+    }
+    bool match = (diff < tolerance);
+    success = success && match;
+
+    // Report
+    double us_old = 1e6 * time_old / (double)(num_samples - 1);
+    double us_new = 1e6 * time_new / (double)(num_samples - 1);
+    printf("[BENCH]: |w| ~ %.3f rad/s | old %.3f us | new %.3f us per sample (%.2fx) | max rel diff %.2e (%s)\n", mag_w, us_old, us_new,
+           us_old / us_new, diff, match ? "match" : "MISMATCH");
+  }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
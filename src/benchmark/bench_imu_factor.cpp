@@ -0,0 +1,163 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <Eigen/Eigen>
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/linear/GaussianFactor.h>
+#include <gtsam/nonlinear/NonlinearFactor.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include "benchmark/ImuFactorCPIv1Reference.h"
+#include "cpi/CpiV1.h"
+#include "gtsam/ImuFactorCPIv1.h"
+#include "gtsam/JPLNavState.h"
+#include "gtsam/RotationXY.h"
+#include "utils/quat_ops.h"
+
+using gtsam::symbol_shorthand::G; // G: global gravity rotation into the vicon frame
+using gtsam::symbol_shorthand::X; // X: our JPL states
+
+/**
+ * Micro-benchmark of ImuFactorCPIv1 linearization against the previous implementation (see ImuFactorCPIv1Reference).
+ *
+ * We create random states, preintegrate a random IMU stream between each with CpiV1, and create both factors from it.
+ * Each factor is then linearized through GTSAM, both by just evaluating the Jacobians (unwhitenedError) and by
+ * creating the whitened JacobianFactor the optimizer uses (linearize). We report the time per factor for each, along
+ * with the largest difference of the residuals and Jacobians between the two implementations.
+ *
+ * Usage: bench_imu_factor [num_factors] [num_reps]
+ */
+
+// Our IMU noises and rates (close to what we see on real datasets)
+static const double SIGMA_W = 1.6968e-04;
+static const double SIGMA_WB = 1.9393e-05;
+static const double SIGMA_A = 2.0000e-3;
+static const double SIGMA_AB = 3.0000e-3;
+static const double IMU_RATE = 200.0;
+static const double STATE_DT = 0.1;
+static const double GRAVITY = 9.81;
+
+/// Seconds it takes to evaluate the error and Jacobians of all factors
+double time_jacobians(const gtsam::NonlinearFactorGraph &factors, const gtsam::Values &values, int num_reps, double &checksum) {
+  std::vector<gtsam::Matrix> H(3);
+  auto t0 = std::chrono::steady_clock::now();
+  for (int r = 0; r < num_reps; r++) {
+    for (const auto &factor : factors) {
+      auto factor_noise = boost::static_pointer_cast<gtsam::NoiseModelFactor>(factor);
+      checksum += factor_noise->unwhitenedError(values, H).norm() + H.at(0)(0, 0);
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(t1 - t0).count();
+}
+
+/// Seconds it takes to linearize all factors into JacobianFactors (what the optimizer does)
+double time_linearize(const gtsam::NonlinearFactorGraph &factors, const gtsam::Values &values, int num_reps, double &checksum) {
+  auto t0 = std::chrono::steady_clock::now();
+  for (int r = 0; r < num_reps; r++) {
+    for (const auto &factor : factors) {
+      gtsam::GaussianFactor::shared_ptr linear = factor->linearize(values);
+      checksum += (double)linear->size();
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(t1 - t0).count();
+}
+
+int main(int argc, char **argv) {
+
+  // Parameters
+  size_t num_factors = (argc > 1) ? (size_t)std::atol(argv[1]) : 2000;
+  int num_reps = (argc > 2) ? std::atoi(argv[2]) : 100;
+  const double tolerance = 1e-9;
+  printf("[BENCH]: %zu factors x %d reps\n", num_factors, num_reps);
+
+  // Create our random states, and the gravity rotation
+  std::mt19937 gen(42);
+  std::normal_distribution<double> noise(0.0, 1.0);
+  auto randn = [&](double sigma) { return Eigen::Vector3d(sigma * noise(gen), sigma * noise(gen), sigma * noise(gen)); };
+  gtsam::Values values;
+  for (size_t i = 0; i <= num_factors; i++) {
+    Eigen::Vector4d q = rot_2_quat(exp_so3(randn(1.0)));
+    JPLNavState state(i * STATE_DT, q, randn(1e-3), randn(1.0), randn(1e-2), randn(5.0));
+    values.insert(X(i), state);
+  }
+  values.insert(G(0), RotationXY(0.01, -0.02));
+
+  // Preintegrate between each state, and create both versions of the factor from it
+  gtsam::NonlinearFactorGraph factors_new, factors_old;
+  size_t num_imu = (size_t)std::round(STATE_DT * IMU_RATE);
+  for (size_t i = 0; i < num_factors; i++) {
+    CpiV1 preint(SIGMA_W, SIGMA_WB, SIGMA_A, SIGMA_AB, true);
+    preint.setLinearizationPoints(randn(1e-3), randn(1e-2));
+    Eigen::Vector3d w_axis = randn(1.0);
+    Eigen::Vector3d wm0 = w_axis + randn(1e-3), am0 = Eigen::Vector3d(0, 0, GRAVITY) + randn(0.1);
+    for (size_t k = 0; k < num_imu; k++) {
+      Eigen::Vector3d wm1 = w_axis + randn(1e-3), am1 = Eigen::Vector3d(0, 0, GRAVITY) + randn(0.1);
+      preint.feed_IMU(k / IMU_RATE, (k + 1) / IMU_RATE, wm0, am0, wm1, am1);
+      wm0 = wm1;
+      am0 = am1;
+    }
+    factors_new.push_back(boost::make_shared<ImuFactorCPIv1>(X(i), X(i + 1), G(0), preint.P_meas, preint.DT, GRAVITY, preint.alpha_tau,
+                                                             preint.beta_tau, preint.q_k2tau, preint.b_a_lin, preint.b_w_lin, preint.J_q,
+                                                             preint.J_b, preint.J_a, preint.H_b, preint.H_a));
+    factors_old.push_back(boost::make_shared<ImuFactorCPIv1Reference>(
+        X(i), X(i + 1), G(0), preint.P_meas, preint.DT, GRAVITY, preint.alpha_tau, preint.beta_tau, preint.q_k2tau, preint.b_a_lin,
+        preint.b_w_lin, preint.J_q, preint.J_b, preint.J_a, preint.H_b, preint.H_a));
+  }
+
+  // Compare the residual and all Jacobians of each factor
+  double diff = 0.0;
+  for (size_t i = 0; i < num_factors; i++) {
+    std::vector<gtsam::Matrix> H_new(3), H_old(3);
+    gtsam::Vector err_new = boost::static_pointer_cast<gtsam::NoiseModelFactor>(factors_new.at(i))->unwhitenedError(values, H_new);
+    gtsam::Vector err_old = boost::static_pointer_cast<gtsam::NoiseModelFactor>(factors_old.at(i))->unwhitenedError(values, H_old);
+    diff = std::max(diff, (err_new - err_old).cwiseAbs().maxCoeff());
+    for (size_t j = 0; j < 3; j++) {
+      diff = std::max(diff, (H_new.at(j) - H_old.at(j)).cwiseAbs().maxCoeff());
+    }
+  }
+  bool match = (diff < tolerance);
+
+  // Time both (one warm up pass first)
+  double checksum = 0.0;
+  time_jacobians(factors_old, values, 1, checksum);
+  time_jacobians(factors_new, values, 1, checksum);
+  double jac_old = time_jacobians(factors_old, values, num_reps, checksum);
+  double jac_new = time_jacobians(factors_new, values, num_reps, checksum);
+  double lin_old = time_linearize(factors_old, values, num_reps, checksum);
+  double lin_new = time_linearize(factors_new, values, num_reps, checksum);
+
+  // Report
+  double num_evals = (double)num_factors * num_reps;
+  printf("[BENCH]: jacobians | old %.3f us | new %.3f us per factor (%.2fx)\n", 1e6 * jac_old / num_evals, 1e6 * jac_new / num_evals,
+         jac_old / jac_new);
+  printf("[BENCH]: linearize | old %.3f us | new %.3f us per factor (%.2fx)\n", 1e6 * lin_old / num_evals, 1e6 * lin_new / num_evals,
+         lin_old / lin_new);
+  printf("[BENCH]: max abs diff %.2e (%s) | checksum %.6e\n", diff, match ? "match" : "MISMATCH", checksum);
+  return match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -78,9 +78,9 @@ public:
   /**
    * @brief Function that handles new IMU messages, will precompound our means, jacobians, and measurement covariance
    */
-  virtual void feed_IMU(double t_0, double t_1, Eigen::Matrix<double, 3, 1> w_m_0, Eigen::Matrix<double, 3, 1> a_m_0,
-                        Eigen::Matrix<double, 3, 1> w_m_1 = Eigen::Matrix<double, 3, 1>::Zero(),
-                        Eigen::Matrix<double, 3, 1> a_m_2 = Eigen::Matrix<double, 3, 1>::Zero()) = 0;
+  virtual void feed_IMU(double t_0, double t_1, const Eigen::Matrix<double, 3, 1> &w_m_0, const Eigen::Matrix<double, 3, 1> &a_m_0,
+                        const Eigen::Matrix<double, 3, 1> &w_m_1 = Eigen::Matrix<double, 3, 1>::Zero(),
+                        const Eigen::Matrix<double, 3, 1> &a_m_2 = Eigen::Matrix<double, 3, 1>::Zero()) = 0;
 
   // Flag if we should perform IMU averaging or not
   // For version 1 we should average the measurement
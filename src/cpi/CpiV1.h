@@ -54,10 +54,11 @@ public:
    * @brief Our precompound function for Model 1
    * We will first analytically integrate our means, and Jacobians
    * Then we perform numerical integration for our measurement covariance
+   * This is called for every IMU reading, so all matrices here are fixed size (no heap allocations).
    */
-  void feed_IMU(double t_0, double t_1, Eigen::Matrix<double, 3, 1> w_m_0, Eigen::Matrix<double, 3, 1> a_m_0,
-                Eigen::Matrix<double, 3, 1> w_m_1 = Eigen::Matrix<double, 3, 1>::Zero(),
-                Eigen::Matrix<double, 3, 1> a_m_1 = Eigen::Matrix<double, 3, 1>::Zero()) {
+  void feed_IMU(double t_0, double t_1, const Eigen::Matrix<double, 3, 1> &w_m_0, const Eigen::Matrix<double, 3, 1> &a_m_0,
+                const Eigen::Matrix<double, 3, 1> &w_m_1 = Eigen::Matrix<double, 3, 1>::Zero(),
+                const Eigen::Matrix<double, 3, 1> &a_m_1 = Eigen::Matrix<double, 3, 1>::Zero()) {
 
     // Get time difference
     double delta_t = t_1 - t_0;
@@ -140,8 +141,8 @@ public:
     Eigen::Matrix<double, 3, 3> Beta_arg = (delta_t * eye3 + f_3 * w_x + f_4 * w_x_2);
 
     // Matrices that will multiply the a_hat in the update expressions
-    Eigen::MatrixXd H_al = R_tau12k * alpha_arg;
-    Eigen::MatrixXd H_be = R_tau12k * Beta_arg;
+    Eigen::Matrix<double, 3, 3> H_al = R_tau12k * alpha_arg;
+    Eigen::Matrix<double, 3, 3> H_be = R_tau12k * Beta_arg;
 
     // Update the measurement means
     alpha_tau += beta_tau * delta_t + H_al * a_hat;
@@ -165,9 +166,9 @@ public:
     H_b -= H_be;
 
     // Derivatives of R_tau12k wrt bias_w entries
-    Eigen::MatrixXd d_R_bw_1 = -R_tau12k * skew_x(J_q * e_1);
-    Eigen::MatrixXd d_R_bw_2 = -R_tau12k * skew_x(J_q * e_2);
-    Eigen::MatrixXd d_R_bw_3 = -R_tau12k * skew_x(J_q * e_3);
+    Eigen::Matrix<double, 3, 3> d_R_bw_1 = -R_tau12k * skew_x(J_q * e_1);
+    Eigen::Matrix<double, 3, 3> d_R_bw_2 = -R_tau12k * skew_x(J_q * e_2);
+    Eigen::Matrix<double, 3, 3> d_R_bw_3 = -R_tau12k * skew_x(J_q * e_3);
 
     // Now compute the gyro bias Jacobian terms
     double df_1_dbw_1;
@@ -254,91 +255,79 @@ public:
     R_mid = R_mid * R_k2tau;
 
     // Compute covariance (in this implementation, we use RK4)
-    // k1-------------------------------------------------------------------------------------------------
-
-    // Build state Jacobian
-    Eigen::Matrix<double, 15, 15> F_k1 = Eigen::Matrix<double, 15, 15>::Zero();
-    F_k1.block(0, 0, 3, 3) = -w_x;
-    F_k1.block(0, 3, 3, 3) = -eye3;
-    F_k1.block(6, 0, 3, 3) = -R_k2tau.transpose() * a_x;
-    F_k1.block(6, 9, 3, 3) = -R_k2tau.transpose();
-    F_k1.block(12, 6, 3, 3) = eye3;
-
-    // Build noise Jacobian
-    Eigen::Matrix<double, 15, 12> G_k1 = Eigen::Matrix<double, 15, 12>::Zero();
-    G_k1.block(0, 0, 3, 3) = -eye3;
-    G_k1.block(3, 3, 3, 3) = eye3;
-    G_k1.block(6, 6, 3, 3) = -R_k2tau.transpose();
-    G_k1.block(9, 9, 3, 3) = eye3;
+    // The state and noise Jacobians at each step only differ in the rotation they are evaluated at
+    // k1 uses the start orientation, k2 and k3 the midpoint, and k4 the end orientation
 
-    // Get covariance derivative
-    Eigen::Matrix<double, 15, 15> P_dot_k1 = F_k1 * P_meas + P_meas * F_k1.transpose() + G_k1 * Q_c * G_k1.transpose();
+    // k1-------------------------------------------------------------------------------------------------
+    Eigen::Matrix<double, 15, 15> P_dot_k1;
+    compute_P_dot(w_x, a_x, R_k2tau.transpose(), P_meas, P_dot_k1);
 
     // k2-------------------------------------------------------------------------------------------------
-
-    // Build state Jacobian
-    Eigen::Matrix<double, 15, 15> F_k2 = Eigen::Matrix<double, 15, 15>::Zero();
-    F_k2.block(0, 0, 3, 3) = -w_x;
-    F_k2.block(0, 3, 3, 3) = -eye3;
-    F_k2.block(6, 0, 3, 3) = -R_mid.transpose() * a_x;
-    F_k2.block(6, 9, 3, 3) = -R_mid.transpose();
-    F_k2.block(12, 6, 3, 3) = eye3;
-
-    // Build noise Jacobian
-    Eigen::Matrix<double, 15, 12> G_k2 = Eigen::Matrix<double, 15, 12>::Zero();
-    G_k2.block(0, 0, 3, 3) = -eye3;
-    G_k2.block(3, 3, 3, 3) = eye3;
-    G_k2.block(6, 6, 3, 3) = -R_mid.transpose();
-    G_k2.block(9, 9, 3, 3) = eye3;
-
-    // Get covariance derivative
     Eigen::Matrix<double, 15, 15> P_k2 = P_meas + P_dot_k1 * delta_t / 2.0;
-    Eigen::Matrix<double, 15, 15> P_dot_k2 = F_k2 * P_k2 + P_k2 * F_k2.transpose() + G_k2 * Q_c * G_k2.transpose();
+    Eigen::Matrix<double, 15, 15> P_dot_k2;
+    compute_P_dot(w_x, a_x, R_mid.transpose(), P_k2, P_dot_k2);
 
     // k3-------------------------------------------------------------------------------------------------
-
-    // Our state and noise Jacobians are the same as k2
-    // Since k2 and k3 correspond to the same estimates for the midpoint
-    Eigen::Matrix<double, 15, 15> F_k3 = F_k2;
-    Eigen::Matrix<double, 15, 12> G_k3 = G_k2;
-
-    // Get covariance derivative
     Eigen::Matrix<double, 15, 15> P_k3 = P_meas + P_dot_k2 * delta_t / 2.0;
-    Eigen::Matrix<double, 15, 15> P_dot_k3 = F_k3 * P_k3 + P_k3 * F_k3.transpose() + G_k3 * Q_c * G_k3.transpose();
+    Eigen::Matrix<double, 15, 15> P_dot_k3;
+    compute_P_dot(w_x, a_x, R_mid.transpose(), P_k3, P_dot_k3);
 
     // k4-------------------------------------------------------------------------------------------------
-
-    // Build state Jacobian
-    Eigen::Matrix<double, 15, 15> F_k4 = Eigen::Matrix<double, 15, 15>::Zero();
-    F_k4.block(0, 0, 3, 3) = -w_x;
-    F_k4.block(0, 3, 3, 3) = -eye3;
-    F_k4.block(6, 0, 3, 3) = -R_k2tau1.transpose() * a_x;
-    F_k4.block(6, 9, 3, 3) = -R_k2tau1.transpose();
-    F_k4.block(12, 6, 3, 3) = eye3;
-
-    // Build noise Jacobian
-    Eigen::Matrix<double, 15, 12> G_k4 = Eigen::Matrix<double, 15, 12>::Zero();
-    G_k4.block(0, 0, 3, 3) = -eye3;
-    G_k4.block(3, 3, 3, 3) = eye3;
-    G_k4.block(6, 6, 3, 3) = -R_k2tau1.transpose();
-    G_k4.block(9, 9, 3, 3) = eye3;
-
-    // Get covariance derivative
     Eigen::Matrix<double, 15, 15> P_k4 = P_meas + P_dot_k3 * delta_t;
-    Eigen::Matrix<double, 15, 15> P_dot_k4 = F_k4 * P_k4 + P_k4 * F_k4.transpose() + G_k4 * Q_c * G_k4.transpose();
+    Eigen::Matrix<double, 15, 15> P_dot_k4;
+    compute_P_dot(w_x, a_x, R_k2tau1.transpose(), P_k4, P_dot_k4);
 
     // done-------------------------------------------------------------------------------------------------
 
     // Collect covariance solution
     // Ensure it is positive definite
     P_meas += (delta_t / 6.0) * (P_dot_k1 + 2.0 * P_dot_k2 + 2.0 * P_dot_k3 + P_dot_k4);
-    P_meas = 0.5 * (P_meas + P_meas.transpose());
+    P_meas = 0.5 * (P_meas + P_meas.transpose()).eval();
 
     // Update rotation mean
     // Note we had to wait to do this, since we use the old orientation in our covariance calculation
     R_k2tau = R_k2tau1;
     q_k2tau = rot_2_quat(R_k2tau);
   }
+
+private:
+  /**
+   * @brief Computes the derivative of our measurement covariance, P_dot = F*P + P*F^T + G*Q_c*G^T
+   *
+   * Our state Jacobian F and noise Jacobian G are mostly zero / identity blocks:
+   * - F has -w_x and -I on the orientation row, -R*a_x and -R on the beta row, and I on the alpha row
+   * - G is block diagonal with -I, I, -R, and I, with the alpha rows being zero
+   *
+   * Thus we directly compute the non-zero blocks of each product instead of doing full 15x15 multiplications.
+   *
+   * @param w_x Skew of the bias corrected angular velocity
+   * @param a_x Skew of the bias corrected linear acceleration
+   * @param R_tau2k Rotation from the current local frame to the start frame the Jacobians are evaluated at
+   * @param P Covariance we are evaluating the derivative at
+   * @param P_dot Derivative of the covariance
+   */
+  void compute_P_dot(const Eigen::Matrix<double, 3, 3> &w_x, const Eigen::Matrix<double, 3, 3> &a_x,
+                     const Eigen::Matrix<double, 3, 3> &R_tau2k, const Eigen::Matrix<double, 15, 15> &P,
+                     Eigen::Matrix<double, 15, 15> &P_dot) const {
+
+    // State Jacobian times covariance (F*P)
+    Eigen::Matrix<double, 3, 3> R_a_x = R_tau2k * a_x;
+    P_dot.setZero();
+    P_dot.block<3, 15>(0, 0).noalias() = -w_x * P.block<3, 15>(0, 0) - P.block<3, 15>(3, 0);
+    P_dot.block<3, 15>(6, 0).noalias() = -R_a_x * P.block<3, 15>(0, 0) - R_tau2k * P.block<3, 15>(9, 0);
+    P_dot.block<3, 15>(12, 0) = P.block<3, 15>(6, 0);
+
+    // Add its transpose (P*F^T)
+    P_dot += P_dot.transpose().eval();
+
+    // Noise Jacobian on our continuous-time noise (G*Q_c*G^T)
+    Eigen::Matrix<double, 12, 12> GQGt = Q_c;
+    GQGt.block<3, 12>(0, 0) *= -1.0;
+    GQGt.block<12, 3>(0, 0) *= -1.0;
+    GQGt.block<3, 12>(6, 0) = (-R_tau2k * GQGt.block<3, 12>(6, 0)).eval();
+    GQGt.block<12, 3>(0, 6) = (GQGt.block<12, 3>(0, 6) * -R_tau2k.transpose()).eval();
+    P_dot.block<12, 12>(0, 0) += GQGt;
+  }
 };
 
 #endif /* CPI_V1_H */
@@ -23,25 +23,26 @@
 #include <unistd.h>
 #include <vector>
 
-#include <geometry_msgs/PoseStamped.h>
-#include <geometry_msgs/TransformStamped.h>
-#include <nav_msgs/Odometry.h>
 #include <ros/ros.h>
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
-#include <sensor_msgs/Image.h>
-#include <sensor_msgs/Imu.h>
 
+#include "meas/BagLoader.h"
 #include "meas/Interpolator.h"
+#include "meas/MeasCache.h"
 #include "meas/Propagator.h"
+#include "solver/StateGridPlanner.h"
 #include "solver/ViconGraphSolver.h"
+#include "utils/parallel.h"
+#include "utils/profiler.h"
 
 int main(int argc, char **argv) {
 
   // Start up
   ros::init(argc, argv, "estimate_vicon2gt");
   ros::NodeHandle nh("~");
-  auto rT1 = boost::posix_time::microsec_clock::local_time();
+  std::shared_ptr<Profiler> profiler = std::make_shared<Profiler>();
+  Profiler::Scope timer_total(profiler, "total");
 
   // Load the imu, camera, and vicon topics
   std::string topic_imu, topic_vicon;
@@ -49,22 +50,60 @@ int main(int argc, char **argv) {
   nh.param<std::string>("topic_vicon", topic_vicon, "/vicon/ironsides/odom");
 
   // Load the bag path
-  bool save_to_file, use_manual_sigmas;
-  std::string path_to_bag, path_states, path_info;
+  bool save_to_file, use_manual_sigmas, use_cache;
+  std::string path_to_bag, path_states, path_info, path_cache;
   int state_freq;
   nh.param<std::string>("path_bag", path_to_bag, "bagfile.bag");
+  nh.param<bool>("use_cache", use_cache, false);
+  nh.param<std::string>("path_cache", path_cache, path_to_bag + ".v2gt");
   nh.param<std::string>("stats_path_states", path_states, "gt_states.csv");
   nh.param<std::string>("stats_path_info", path_info, "vicon2gt_info.txt");
+  std::string path_timing = (boost::filesystem::path(path_info).parent_path() / boost::filesystem::path(path_info).stem()).string();
+  std::string path_convergence = path_timing + "_convergence.csv";
+  nh.param<std::string>("stats_path_timing", path_timing, path_timing + "_timing.json");
+  nh.param<std::string>("stats_path_convergence", path_convergence, path_convergence);
   nh.param<bool>("save_to_file", save_to_file, save_to_file);
   nh.param<bool>("use_manual_sigmas", use_manual_sigmas, false);
   nh.param<int>("state_freq", state_freq, 100);
+
+  // If our states are on a uniform grid, or placed adaptively to the motion (state_freq is then the fastest rate)
+  std::string state_placement;
+  PlacementParams placement;
+  nh.param<std::string>("state_placement", state_placement, "uniform");
+  nh.param<double>("state_freq_min", placement.freq_min, placement.freq_min);
+  nh.param<double>("state_thresh_rot", placement.thresh_rot, placement.thresh_rot);
+  nh.param<double>("state_thresh_accel", placement.thresh_accel, placement.thresh_accel);
+  nh.param<double>("state_thresh_vicon_gap", placement.thresh_vicon_gap, placement.thresh_vicon_gap);
+  nh.param<double>("toff_imu_to_vicon", placement.toff_imu_to_vicon, placement.toff_imu_to_vicon);
+  if (state_placement != "uniform" && state_placement != "adaptive") {
+    ROS_ERROR("state_placement should be uniform or adaptive (got %s)", state_placement.c_str());
+    ROS_ERROR("%s on line %d", __FILE__, __LINE__);
+    std::exit(EXIT_FAILURE);
+  }
+
+  // Number of threads we will decode the bag with (zero or negative will use all hardware threads)
+  int num_threads;
+  nh.param<int>("num_threads", num_threads, -1);
+  num_threads = get_num_threads(num_threads);
   ROS_INFO("rosbag information...");
   ROS_INFO("    - bag path: %s", path_to_bag.c_str());
+  ROS_INFO("    - use cache: %d", (int)use_cache);
+  ROS_INFO("    - cache path: %s", path_cache.c_str());
   ROS_INFO("    - state path: %s", path_states.c_str());
   ROS_INFO("    - info path: %s", path_info.c_str());
+  ROS_INFO("    - timing path: %s", path_timing.c_str());
+  ROS_INFO("    - convergence path: %s", path_convergence.c_str());
   ROS_INFO("    - save to file: %d", (int)save_to_file);
   ROS_INFO("    - use manual sigmas: %d", (int)use_manual_sigmas);
   ROS_INFO("    - state_freq: %d", state_freq);
+  ROS_INFO("    - state_placement: %s", state_placement.c_str());
+  if (state_placement == "adaptive") {
+    ROS_INFO("    - state_freq_min: %.2f", placement.freq_min);
+    ROS_INFO("    - state_thresh_rot: %.4f", placement.thresh_rot);
+    ROS_INFO("    - state_thresh_accel: %.4f", placement.thresh_accel);
+    ROS_INFO("    - state_thresh_vicon_gap: %.4f", placement.thresh_vicon_gap);
+  }
+  ROS_INFO("    - num_threads: %d", num_threads);
 
   // Get our start location and how much of the bag we want to play
   // Make the bag duration < 0 to just process to the end of the bag
@@ -76,42 +115,6 @@ int main(int argc, char **argv) {
   //===================================================================================
   //===================================================================================
 
-  // Load rosbag here, and find messages we can play
-  rosbag::Bag bag;
-  bag.open(path_to_bag, rosbag::bagmode::Read);
-
-  // We should load the bag as a view
-  // Here we go from beginning of the bag to the end of the bag
-  rosbag::View view_full;
-  rosbag::View view;
-
-  // Start a few seconds in from the full view time
-  // If we have a negative duration then use the full bag length
-  view_full.addQuery(bag, rosbag::TopicQuery({topic_imu, topic_vicon}));
-  ros::Time time_init = view_full.getBeginTime();
-  time_init += ros::Duration(bag_start);
-  ros::Time time_finish = (bag_durr < 0) ? view_full.getEndTime() : time_init + ros::Duration(bag_durr);
-  ROS_INFO("loading rosbag into memory...");
-  ROS_INFO("    - time start = %.6f", time_init.toSec());
-  ROS_INFO("    - time end   = %.6f", time_finish.toSec());
-  ROS_INFO("    - duration   = %.2f (secs)", time_finish.toSec() - time_init.toSec());
-  view.addQuery(bag, rosbag::TopicQuery({topic_imu, topic_vicon}), time_init, time_finish);
-
-  // Check to make sure we have data to play
-  if (view.size() == 0) {
-    ROS_ERROR("No messages to play on specified topics.  Exiting.");
-    ROS_ERROR("IMU TOPIC: %s", topic_imu.c_str());
-    ROS_ERROR("VIC TOPIC: %s", topic_vicon.c_str());
-    ros::shutdown();
-    return EXIT_FAILURE;
-  }
-  auto rT2 = boost::posix_time::microsec_clock::local_time();
-  ROS_INFO("\u001b[34m[TIME]: %.4f to load bag\u001b[0m", (rT2 - rT1).total_microseconds() * 1e-6);
-
-  //===================================================================================
-  //===================================================================================
-  //===================================================================================
-
   // Our IMU noise values
   double sigma_w, sigma_wb, sigma_a, sigma_ab;
   nh.param<double>("gyroscope_noise_density", sigma_w, 1.6968e-04);
@@ -149,125 +152,132 @@ int main(int argc, char **argv) {
   // Check if we have any interval with long gap of no vicon measurements
   // We can still try to process, but if it is too long, then the IMU can drift
   // Thus just warn the user that there might be an issue!
+  double time_init = -1;
   double last_vicon_time = -1;
   double max_vicon_lost_time = 1.0; // seconds
   auto warn_amount_vicon_rate = [&](double timestamp, double timestamp_last) {
     double vicon_dt = timestamp - timestamp_last;
     if (last_vicon_time == -1 || vicon_dt < max_vicon_lost_time)
       return;
-    double dist_from_start = timestamp_last - time_init.toSec();
+    double dist_from_start = timestamp_last - time_init;
     ROS_WARN("over %.2f seconds of no vicon!! (starting %.2f sec into bag)", vicon_dt, dist_from_start);
   };
 
-  // Step through the rosbag
-  ROS_INFO("load custom data into memory...");
-  for (const rosbag::MessageInstance &m : view) {
-
-    // If ros is wants us to stop, break out
-    if (!ros::ok())
-      break;
+  // Feeds a measurement into our data storage objects
+  auto feed_measurement = [&](const BAGDATA &data) {
 
     // Handle IMU messages
-    sensor_msgs::Imu::ConstPtr s0 = m.instantiate<sensor_msgs::Imu>();
-    if (s0 != nullptr && m.getTopic() == topic_imu) {
-      Eigen::Vector3d wm, am;
-      wm << s0->angular_velocity.x, s0->angular_velocity.y, s0->angular_velocity.z;
-      am << s0->linear_acceleration.x, s0->linear_acceleration.y, s0->linear_acceleration.z;
-      propagator->feed_imu(s0->header.stamp.toSec(), wm, am);
+    if (data.type == BagDataType::IMU) {
+      propagator->feed_imu(data.timestamp, data.wm, data.am);
       ct_imu++;
-      continue;
+      return;
     }
 
     // Handle VICON messages
-    nav_msgs::Odometry::ConstPtr s2 = m.instantiate<nav_msgs::Odometry>();
-    if (s2 != nullptr && m.getTopic() == topic_vicon) {
-      // load orientation and position of the vicon
-      Eigen::Vector4d q;
-      Eigen::Vector3d p;
-      q << s2->pose.pose.orientation.x, s2->pose.pose.orientation.y, s2->pose.pose.orientation.z, s2->pose.pose.orientation.w;
-      p << s2->pose.pose.position.x, s2->pose.pose.position.y, s2->pose.pose.position.z;
-      // load the covariance of the pose (order=x,y,z,rx,ry,rz) stored row-major
-      Eigen::Matrix<double, 6, 6> pose_cov;
-      for (size_t c = 0; c < 6; c++) {
-        for (size_t r = 0; r < 6; r++) {
-          pose_cov(r, c) = s2->pose.covariance[6 * c + r];
-        }
-      }
-      // Overwrite if using manual sigmas
-      if (use_manual_sigmas) {
-        pose_cov = Eigen::Matrix<double, 6, 6>::Zero();
-        pose_cov.block(3, 3, 3, 3) = R_q;
-        pose_cov.block(0, 0, 3, 3) = R_p;
-      }
-      // Eigen::Map<Eigen::Matrix<double,6,6,Eigen::RowMajor>> pose_cov(s2->pose.covariance.begin(),36,1);
-      //  feed it!
-      interpolator->feed_pose(s2->header.stamp.toSec(), q, p, pose_cov.block(3, 3, 3, 3), pose_cov.block(0, 0, 3, 3));
-      ct_vic++;
-      // update timestamps
-      if (start_time == -1) {
-        start_time = s2->header.stamp.toSec();
-      }
-      if (start_time != -1) {
-        end_time = s2->header.stamp.toSec();
-      }
-      warn_amount_vicon_rate(s2->header.stamp.toSec(), last_vicon_time);
-      last_vicon_time = s2->header.stamp.toSec();
-      continue;
+    // Only odometry messages have a covariance, and we overwrite it if using manual sigmas
+    Eigen::Matrix3d R_q_vicon = R_q;
+    Eigen::Matrix3d R_p_vicon = R_p;
+    if (data.type == BagDataType::VICON_ODOM && !use_manual_sigmas) {
+      R_q_vicon = data.pose_cov.block(3, 3, 3, 3);
+      R_p_vicon = data.pose_cov.block(0, 0, 3, 3);
     }
-
-    // Handle VICON messages
-    geometry_msgs::TransformStamped::ConstPtr s3 = m.instantiate<geometry_msgs::TransformStamped>();
-    if (s3 != nullptr && m.getTopic() == topic_vicon) {
-      // load orientation and position of the vicon
-      Eigen::Vector4d q;
-      Eigen::Vector3d p;
-      q << s3->transform.rotation.x, s3->transform.rotation.y, s3->transform.rotation.z, s3->transform.rotation.w;
-      p << s3->transform.translation.x, s3->transform.translation.y, s3->transform.translation.z;
-      // feed it!
-      interpolator->feed_pose(s3->header.stamp.toSec(), q, p, R_q, R_p);
-      ct_vic++;
-      // update timestamps
-      if (start_time == -1) {
-        start_time = s3->header.stamp.toSec();
-      }
-      if (start_time != -1) {
-        end_time = s3->header.stamp.toSec();
-      }
-      warn_amount_vicon_rate(s3->header.stamp.toSec(), last_vicon_time);
-      last_vicon_time = s3->header.stamp.toSec();
-      continue;
+    interpolator->feed_pose(data.timestamp, data.q, data.p, R_q_vicon, R_p_vicon);
+    ct_vic++;
+    // update timestamps
+    if (start_time == -1) {
+      start_time = data.timestamp;
+    }
+    if (start_time != -1) {
+      end_time = data.timestamp;
     }
+    warn_amount_vicon_rate(data.timestamp, last_vicon_time);
+    last_vicon_time = data.timestamp;
+  };
 
-    // Handle VICON messages
-    geometry_msgs::PoseStamped::ConstPtr s4 = m.instantiate<geometry_msgs::PoseStamped>();
-    if (s4 != nullptr && m.getTopic() == topic_vicon) {
-      // load orientation and position of the vicon
-      Eigen::Vector4d q;
-      Eigen::Vector3d p;
-      q << s4->pose.orientation.x, s4->pose.orientation.y, s4->pose.orientation.z, s4->pose.orientation.w;
-      p << s4->pose.position.x, s4->pose.position.y, s4->pose.position.z;
-      // feed it!
-      interpolator->feed_pose(s4->header.stamp.toSec(), q, p, R_q, R_p);
-      ct_vic++;
-      // update timestamps
-      if (start_time == -1) {
-        start_time = s4->header.stamp.toSec();
-      }
-      if (start_time != -1) {
-        end_time = s4->header.stamp.toSec();
+  //===================================================================================
+  //===================================================================================
+  //===================================================================================
+
+  // First try to load from our cache, which is keyed by the bag and what we are loading from it
+  MeasCache cache(path_cache, MeasCache::compute_key(path_to_bag, topic_imu, topic_vicon, bag_start, bag_durr));
+  bool loaded_cache = false;
+  if (use_cache) {
+    Profiler::Scope timer_cache(profiler, "load_cache");
+    loaded_cache = cache.load(time_init, feed_measurement);
+    if (loaded_cache) {
+      ROS_INFO("loaded measurements from cache %s", path_cache.c_str());
+      ROS_INFO("\u001b[34m[TIME]: %.4f to load cache\u001b[0m", timer_cache.stop());
+    }
+  }
+  if (!loaded_cache) {
+
+    // Load rosbag here, and find messages we can play
+    Profiler::Scope timer_open(profiler, "open_bag");
+    rosbag::Bag bag;
+    bag.open(path_to_bag, rosbag::bagmode::Read);
+
+    // We should load the bag as a view
+    // Here we go from beginning of the bag to the end of the bag
+    rosbag::View view_full;
+    rosbag::View view;
+
+    // Start a few seconds in from the full view time
+    // If we have a negative duration then use the full bag length
+    view_full.addQuery(bag, rosbag::TopicQuery({topic_imu, topic_vicon}));
+    ros::Time time_bag_init = view_full.getBeginTime();
+    time_bag_init += ros::Duration(bag_start);
+    ros::Time time_bag_finish = (bag_durr < 0) ? view_full.getEndTime() : time_bag_init + ros::Duration(bag_durr);
+    time_init = time_bag_init.toSec();
+    ROS_INFO("loading rosbag into memory...");
+    ROS_INFO("    - time start = %.6f", time_bag_init.toSec());
+    ROS_INFO("    - time end   = %.6f", time_bag_finish.toSec());
+    ROS_INFO("    - duration   = %.2f (secs)", time_bag_finish.toSec() - time_bag_init.toSec());
+    view.addQuery(bag, rosbag::TopicQuery({topic_imu, topic_vicon}), time_bag_init, time_bag_finish);
+
+    // Check to make sure we have data to play
+    if (view.size() == 0) {
+      ROS_ERROR("No messages to play on specified topics.  Exiting.");
+      ROS_ERROR("IMU TOPIC: %s", topic_imu.c_str());
+      ROS_ERROR("VIC TOPIC: %s", topic_vicon.c_str());
+      ros::shutdown();
+      return EXIT_FAILURE;
+    }
+    ROS_INFO("\u001b[34m[TIME]: %.4f to load bag\u001b[0m", timer_open.stop());
+
+    // Step through the rosbag
+    // Messages are decoded on a pool of threads, but are given to us here in the order they are in the bag
+    ROS_INFO("load custom data into memory...");
+    Profiler::Scope timer_read(profiler, "read_bag");
+    BagLoader loader(topic_imu, topic_vicon, num_threads, profiler);
+    bool loaded_all = loader.load(view, [&](const BAGDATA &data) {
+      feed_measurement(data);
+      if (use_cache)
+        cache.append(data);
+    });
+    ROS_INFO("\u001b[34m[TIME]: %.4f to preprocess\u001b[0m", timer_read.stop());
+
+    // Save to our cache if we loaded the whole bag
+    if (use_cache && loaded_all) {
+      Profiler::Scope timer_cache(profiler, "write_cache");
+      if (cache.write(time_init)) {
+        ROS_INFO("saved measurements to cache %s", path_cache.c_str());
+      } else {
+        ROS_WARN("unable to save measurements to cache %s", path_cache.c_str());
       }
-      warn_amount_vicon_rate(s4->header.stamp.toSec(), last_vicon_time);
-      last_vicon_time = s4->header.stamp.toSec();
-      continue;
     }
   }
-  auto rT3 = boost::posix_time::microsec_clock::local_time();
-  ROS_INFO("\u001b[34m[TIME]: %.4f to preprocess\u001b[0m", (rT3 - rT2).total_microseconds() * 1e-6);
 
   // Create our camera timestamps at the requested fix frequency
+  // Or place them adaptively to the motion, with the requested frequency being the fastest
   int ct_cam = 0;
   std::vector<double> timestamp_cameras;
-  if (start_time != -1 && end_time != -1 && start_time < end_time) {
+  if (start_time != -1 && end_time != -1 && start_time < end_time && state_placement == "adaptive") {
+    placement.freq_max = (double)state_freq;
+    interpolator->seal();
+    timestamp_cameras = StateGridPlanner(propagator).place_adaptive(start_time, end_time, placement, *interpolator);
+    ct_cam = (int)timestamp_cameras.size();
+    ROS_INFO("placed %d adaptive states (%.1f hz average)", ct_cam, ct_cam / (end_time - start_time));
+  } else if (start_time != -1 && end_time != -1 && start_time < end_time) {
     double temp_time = start_time;
     while (temp_time < end_time) {
       timestamp_cameras.push_back(temp_time);
@@ -290,15 +300,23 @@ int main(int argc, char **argv) {
   }
 
   // Create the graph problem, and solve it
-  ViconGraphSolver solver(nh, propagator, interpolator, timestamp_cameras);
+  ViconGraphSolver solver(nh, propagator, interpolator, timestamp_cameras, profiler);
   solver.build_and_solve();
 
   // Visualize onto ROS
   solver.visualize();
 
   // Finally, save to file all the information
+  // The timing report goes alongside it, so it will include the time to write the results
   if (save_to_file) {
     solver.write_to_file(path_states, path_info);
+    timer_total.stop();
+    if (!profiler->write_json(path_timing)) {
+      ROS_WARN("unable to save timing to %s", path_timing.c_str());
+    }
+    if (!solver.get_convergence_monitor()->write_csv(path_convergence)) {
+      ROS_WARN("unable to save convergence trace to %s", path_convergence.c_str());
+    }
   }
 
   // Done!
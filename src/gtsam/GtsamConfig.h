@@ -39,6 +39,9 @@ public:
 
   /// If we want to estimate the position between VICON and IMU
   bool estimate_vicon_imu_pos = true;
+
+  /// Resolution in seconds at which vicon factors will re-use their last interpolated measurement (zero or negative to disable)
+  double vicon_cache_resolution = 1e-6;
 };
 
 #endif // GTSAMCONFIG_H
\ No newline at end of file
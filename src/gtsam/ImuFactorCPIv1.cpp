@@ -27,45 +27,51 @@ gtsam::Vector ImuFactorCPIv1::evaluateError(const JPLNavState &state_i, const JP
                                             boost::optional<Matrix &> H3) const {
 
   // Separate our variables from our states
-  Vector4 q_GtoK = state_i.q();
-  Vector4 q_GtoK1 = state_j.q();
-  Bias3 bg_K = state_i.bg();
-  Bias3 bg_K1 = state_j.bg();
-  Velocity3 v_KinG = state_i.v();
-  Velocity3 v_K1inG = state_j.v();
-  Bias3 ba_K = state_i.ba();
-  Bias3 ba_K1 = state_j.ba();
-  Vector3 p_KinG = state_i.p();
-  Vector3 p_K1inG = state_j.p();
+  const Vector4 q_GtoK = state_i.q();
+  const Vector4 q_GtoK1 = state_j.q();
+  const Bias3 bg_K = state_i.bg();
+  const Bias3 bg_K1 = state_j.bg();
+  const Velocity3 v_KinG = state_i.v();
+  const Velocity3 v_K1inG = state_j.v();
+  const Bias3 ba_K = state_i.ba();
+  const Bias3 ba_K1 = state_j.ba();
+  const Vector3 p_KinG = state_i.p();
+  const Vector3 p_K1inG = state_j.p();
 
   // Estimated gravity in the global frame
   // We do this so our global frame doesn't have to be gravity aligned
   // Global frame in this this file is the vicon frame
-  Vector3 ez = {0, 0, 1};
-  Vector3 grav_inG = rotxy.rot() * gravity_magnitude * ez;
+  const Eigen::Matrix3d R_GtoV = rotxy.rot();
+  const Vector3 grav_inG = gravity_magnitude * R_GtoV.col(2);
+
+  // Rotation of the first state, and the time terms, which are used by both the error and Jacobians
+  const Eigen::Matrix3d R_GtoK = quat_2_Rot(q_GtoK);
+  const double dt_2 = deltatime * deltatime;
+  const Bias3 dbg = bg_K - bg_lin;
+  const Bias3 dba = ba_K - ba_lin;
 
   //================================================================================
   //================================================================================
   //================================================================================
 
   // Calculate effect of bias on the orientation
-  Eigen::Matrix3d ExpB = exp_so3(-J_q.block(0, 0, 3, 3) * (bg_K - bg_lin));
-  Vector4 q_b = rot_2_quat(ExpB);
+  const Eigen::Matrix3d ExpB = exp_so3(-J_q * dbg);
+  const Vector4 q_b = rot_2_quat(ExpB);
 
   // Quaternions used in Jacobian calculations
-  Vector4 q_n = quat_multiply(q_GtoK1, Inv(q_GtoK));
-  Vector4 q_rminus = quat_multiply(q_n, Inv(q_KtoK1));
-  Vector4 q_r = quat_multiply(q_rminus, q_b);
-  Vector4 q_m = quat_multiply(Inv(q_b), q_KtoK1);
+  const Vector4 q_n = quat_multiply(q_GtoK1, Inv(q_GtoK));
+  const Vector4 q_rminus = quat_multiply(q_n, Inv(q_KtoK1));
+  const Vector4 q_r = quat_multiply(q_rminus, q_b);
+  const Vector4 q_m = quat_multiply(Inv(q_b), q_KtoK1);
 
   // Calculate the corrected quaternion (q_GtoK*q_GtoK1^-1*q_meas^-1*q_b)
   // Vector4 q_r = quat_multiply(quat_multiply(q_GtoK1,Inv(q_GtoK)),quat_multiply(Inv(q_KtoK1),q_b));
 
   // Calculate the expected measurement values from the state
-  Vector3 alphahat = quat_2_Rot(q_GtoK) * (p_K1inG - p_KinG - v_KinG * deltatime + 0.5 * grav_inG * std::pow(deltatime, 2));
-  alphahat = alphahat - J_alpha * (bg_K - bg_lin) - H_alpha * (ba_K - ba_lin);
-  Vector3 betahat = quat_2_Rot(q_GtoK) * (v_K1inG - v_KinG + grav_inG * deltatime);
-  betahat = betahat - J_beta * (bg_K - bg_lin) - H_beta * (ba_K - ba_lin);
+  const Vector3 alpha_inK = R_GtoK * (p_K1inG - p_KinG - v_KinG * deltatime + 0.5 * grav_inG * dt_2);
+  const Vector3 beta_inK = R_GtoK * (v_K1inG - v_KinG + grav_inG * deltatime);
+  const Vector3 alphahat = alpha_inK - J_alpha * dbg - H_alpha * dba;
+  const Vector3 betahat = beta_inK - J_beta * dbg - H_beta * dba;
 
   //================================================================================
   //================================================================================
@@ -75,132 +81,97 @@ gtsam::Vector ImuFactorCPIv1::evaluateError(const JPLNavState &state_i, const JP
   Vector15 error;
 
   // Error in our our state in respect to the measurement
-  error.block(0, 0, 3, 1) = 2 * q_r.block(0, 0, 3, 1);
-  error.block(3, 0, 3, 1) = bg_K1 - bg_K;
-  error.block(6, 0, 3, 1) = betahat - beta;
-  error.block(9, 0, 3, 1) = ba_K1 - ba_K;
-  error.block(12, 0, 3, 1) = alphahat - alpha;
+  error.segment<3>(0) = 2 * q_r.head<3>();
+  error.segment<3>(3) = bg_K1 - bg_K;
+  error.segment<3>(6) = betahat - beta;
+  error.segment<3>(9) = ba_K1 - ba_K;
+  error.segment<3>(12) = alphahat - alpha;
 
   //================================================================================
   //================================================================================
   //================================================================================
 
   // Compute the Jacobian in respect to the first JPLNavState if needed
+  // Columns are [theta, biasg, velocity, biasa, position], and we write each non-zero block directly
   if (H1) {
-
-    // Create our five jacobians of the measurement in respect to the state
-    Eigen::Matrix<double, 15, 3> H_theta = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_biasg = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_velocity = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_biasa = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_position = Eigen::Matrix<double, 15, 3>::Zero();
+    H1->setZero(15, 15);
 
     //===========================================================
     // Derivative of q_meas in respect to state theta (t=K)
-    H_theta.block(0, 0, 3, 3) = -((q_n(3, 0) * Eigen::MatrixXd::Identity(3, 3) - skew_x(q_n.block(0, 0, 3, 1))) *
-                                      (q_m(3, 0) * Eigen::MatrixXd::Identity(3, 3) - skew_x(q_m.block(0, 0, 3, 1))) +
-                                  q_n.block(0, 0, 3, 1) * (q_m.block(0, 0, 3, 1)).transpose());
+    H1->block<3, 3>(0, 0) = -((q_n(3) * Eigen::Matrix3d::Identity() - skew_x(q_n.head<3>())) *
+                                  (q_m(3) * Eigen::Matrix3d::Identity() - skew_x(q_m.head<3>())) +
+                              q_n.head<3>() * q_m.head<3>().transpose());
     // Derivative of beta in respect to state theta (t=K)
-    H_theta.block(6, 0, 3, 3) = skew_x(quat_2_Rot(q_GtoK) * (v_K1inG - v_KinG + grav_inG * deltatime));
+    H1->block<3, 3>(6, 0) = skew_x(beta_inK);
     // Derivative of alpha in respect to state theta (t=K)
-    H_theta.block(12, 0, 3, 3) =
-        skew_x(quat_2_Rot(q_GtoK) * (p_K1inG - p_KinG - v_KinG * deltatime + 0.5 * grav_inG * std::pow(deltatime, 2)));
+    H1->block<3, 3>(12, 0) = skew_x(alpha_inK);
 
     //===========================================================
     // Derivative of q_meas in respect to state biasg (t=K)
-    H_biasg.block(0, 0, 3, 3) =
-        (q_rminus(3, 0) * Eigen::MatrixXd::Identity(3, 3) - skew_x(q_rminus.block(0, 0, 3, 1))) * J_q.block(0, 0, 3, 3);
+    H1->block<3, 3>(0, 3) = (q_rminus(3) * Eigen::Matrix3d::Identity() - skew_x(q_rminus.head<3>())) * J_q;
     // Derivative of biasg in respect to state biasg (t=K)
-    H_biasg.block(3, 0, 3, 3) = -Eigen::MatrixXd::Identity(3, 3);
+    H1->block<3, 3>(3, 3) = -Eigen::Matrix3d::Identity();
     // Derivative of beta in respect to state biasg (t=K)
-    H_biasg.block(6, 0, 3, 3) = -J_beta;
+    H1->block<3, 3>(6, 3) = -J_beta;
     // Derivative of alpha in respect to state biasg (t=K)
-    H_biasg.block(12, 0, 3, 3) = -J_alpha;
+    H1->block<3, 3>(12, 3) = -J_alpha;
 
     //===========================================================
     // Derivative of beta in respect to state velocity (t=K)
-    H_velocity.block(6, 0, 3, 3) = -quat_2_Rot(q_GtoK);
+    H1->block<3, 3>(6, 6) = -R_GtoK;
     // Derivative of alpha in respect to state velocity (t=K)
-    H_velocity.block(12, 0, 3, 3) = -deltatime * quat_2_Rot(q_GtoK);
+    H1->block<3, 3>(12, 6) = -deltatime * R_GtoK;
 
     //===========================================================
     // Derivative of beta in respect to state biasa (t=K)
-    H_biasa.block(6, 0, 3, 3) = -H_beta;
+    H1->block<3, 3>(6, 9) = -H_beta;
     // Derivative of biasa in respect to state biasa (t=K)
-    H_biasa.block(9, 0, 3, 3) = -Eigen::MatrixXd::Identity(3, 3);
+    H1->block<3, 3>(9, 9) = -Eigen::Matrix3d::Identity();
     // Derivative of alpha in respect to state biasa (t=K)
-    H_biasa.block(12, 0, 3, 3) = -H_alpha;
+    H1->block<3, 3>(12, 9) = -H_alpha;
 
     //===========================================================
     // Derivative of alpha in respect to state position (t=K)
-    H_position.block(12, 0, 3, 3) = -quat_2_Rot(q_GtoK);
-
-    //===========================================================
-    // Reconstruct the whole Jacobian from the different columns
-    Eigen::Matrix<double, 15, 15> Hi;
-    Hi.block(0, 0, 15, 3) = H_theta;
-    Hi.block(0, 3, 15, 3) = H_biasg;
-    Hi.block(0, 6, 15, 3) = H_velocity;
-    Hi.block(0, 9, 15, 3) = H_biasa;
-    Hi.block(0, 12, 15, 3) = H_position;
-    *H1 = *OptionalJacobian<15, 15>(Hi);
+    H1->block<3, 3>(12, 12) = -R_GtoK;
   }
 
   // Compute the Jacobian in respect to the second JPLNavState if needed
   if (H2) {
-
-    // Create our five jacobians of the measurement in respect to the state
-    Eigen::Matrix<double, 15, 3> H_theta = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_biasg = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_velocity = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_biasa = Eigen::Matrix<double, 15, 3>::Zero();
-    Eigen::Matrix<double, 15, 3> H_position = Eigen::Matrix<double, 15, 3>::Zero();
+    H2->setZero(15, 15);
 
     //===========================================================
     // Derivative of q_meas in respect to state theta (t=K+1)
-    H_theta.block(0, 0, 3, 3) = q_r(3, 0) * Eigen::MatrixXd::Identity(3, 3) + skew_x(q_r.block(0, 0, 3, 1));
+    H2->block<3, 3>(0, 0) = q_r(3) * Eigen::Matrix3d::Identity() + skew_x(q_r.head<3>());
 
     //===========================================================
     // Derivative of biasg in respect to state biasg (t=K+1)
-    H_biasg.block(3, 0, 3, 3) = Eigen::MatrixXd::Identity(3, 3);
+    H2->block<3, 3>(3, 3) = Eigen::Matrix3d::Identity();
 
     //===========================================================
     // Derivative of beta in respect to state velocity (t=K+1)
-    H_velocity.block(6, 0, 3, 3) = quat_2_Rot(q_GtoK);
+    H2->block<3, 3>(6, 6) = R_GtoK;
 
     //===========================================================
     // Derivative of biasa in respect to state biasa (t=K+1)
-    H_biasa.block(9, 0, 3, 3) = Eigen::MatrixXd::Identity(3, 3);
+    H2->block<3, 3>(9, 9) = Eigen::Matrix3d::Identity();
 
     //===========================================================
     // Derivative of alpha in respect to state position (t=K+1)
-    H_position.block(12, 0, 3, 3) = quat_2_Rot(q_GtoK);
-
-    //===========================================================
-    // Reconstruct the whole Jacobian
-    Eigen::Matrix<double, 15, 15> Hj;
-    Hj.block(0, 0, 15, 3) = H_theta;
-    Hj.block(0, 3, 15, 3) = H_biasg;
-    Hj.block(0, 6, 15, 3) = H_velocity;
-    Hj.block(0, 9, 15, 3) = H_biasa;
-    Hj.block(0, 12, 15, 3) = H_position;
-    *H2 = *OptionalJacobian<15, 15>(Hj);
+    H2->block<3, 3>(12, 12) = R_GtoK;
   }
 
   // Jacobian in respect to the global gravity rotation into vicon frame
   if (H3) {
     // Our jacobian
-    Eigen::Matrix<double, 3, 2> H_thetaxy = Eigen::Matrix<double, 3, 2>::Zero();
-    H_thetaxy.block(0, 0, 3, 1) << -std::sin(rotxy.thetay()) * std::sin(rotxy.thetax()), -std::cos(rotxy.thetax()),
-        -std::cos(rotxy.thetay()) * std::sin(rotxy.thetax());
-    H_thetaxy.block(0, 1, 3, 1) << std::cos(rotxy.thetay()) * std::cos(rotxy.thetax()), 0.0,
-        -std::sin(rotxy.thetay()) * std::cos(rotxy.thetax());
+    const double sx = std::sin(rotxy.thetax()), cx = std::cos(rotxy.thetax());
+    const double sy = std::sin(rotxy.thetay()), cy = std::cos(rotxy.thetay());
+    Eigen::Matrix<double, 3, 2> H_thetaxy;
+    H_thetaxy << -sy * sx, cy * cx, -cx, 0.0, -cy * sx, -sy * cx;
     // Derivative of beta, alpha, in respect to our two rotation angles
-    Eigen::Matrix<double, 15, 2> Hg = Eigen::Matrix<double, 15, 2>::Zero();
-    Hg.block(6, 0, 3, 2) = quat_2_Rot(q_GtoK) * deltatime * gravity_magnitude * H_thetaxy;
-    Hg.block(12, 0, 3, 2) = 0.5 * quat_2_Rot(q_GtoK) * std::pow(deltatime, 2) * gravity_magnitude * H_thetaxy;
-    // Reconstruct the whole Jacobian
-    *H3 = *OptionalJacobian<15, 2>(Hg);
+    const Eigen::Matrix<double, 3, 2> R_H_thetaxy = gravity_magnitude * R_GtoK * H_thetaxy;
+    H3->setZero(15, 2);
+    H3->block<3, 2>(6, 0) = deltatime * R_H_thetaxy;
+    H3->block<3, 2>(12, 0) = 0.5 * dt_2 * R_H_thetaxy;
   }
 
   // Debug printing of error and Jacobians
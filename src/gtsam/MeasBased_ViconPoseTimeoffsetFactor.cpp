@@ -45,16 +45,13 @@ gtsam::Vector MeasBased_ViconPoseTimeoffsetFactor::evaluateError(const JPLNavSta
   //================================================================================
 
   // Get our interpolated pose at the node timestep
-  Eigen::Vector4d q_interp;
-  Eigen::Vector3d p_interp;
-  Eigen::Matrix<double, 6, 6> R_interp;
-  Eigen::Matrix<double, 6, 1> H_toff;
-  bool has_vicon = m_interpolator->get_pose_with_jacobian(timestamp_inI - t_off(0), q_interp, p_interp, R_interp, H_toff);
-
-  // Find the sqrt inverse to whittening
-  // This is because our measurement noise can change every iteration based on interpolation
-  Eigen::Matrix<double, 6, 6> sqrt_inv_interp = R_interp.llt().matrixL();
-  sqrt_inv_interp = sqrt_inv_interp.colPivHouseholderQr().solve(Eigen::Matrix<double, 6, 6>::Identity());
+  // This is cached, so only recomputed if the time offset has moved the query time
+  update_cache(timestamp_inI - t_off(0));
+  const bool &has_vicon = m_cache_has_vicon;
+  const Eigen::Vector4d &q_interp = m_cache_q_interp;
+  const Eigen::Vector3d &p_interp = m_cache_p_interp;
+  const Eigen::Matrix<double, 6, 1> &H_toff = m_cache_H_toff;
+  const Eigen::Matrix<double, 6, 6> &sqrt_inv_interp = m_cache_sqrt_inv;
 
   // Our error vector [delta = (orientation, position)]
   Vector6 error;
@@ -140,3 +137,38 @@ gtsam::Vector MeasBased_ViconPoseTimeoffsetFactor::evaluateError(const JPLNavSta
   // Finally return our error vector!
   return error;
 }
+
+void MeasBased_ViconPoseTimeoffsetFactor::update_cache(double timestamp_inV) const {
+
+  // Quantize our query time, and return if we already have this measurement
+  // If the resolution is zero, then we will always recompute
+  bool use_cache = (m_config->vicon_cache_resolution > 0);
+  int64_t key = (use_cache) ? (int64_t)std::llround(timestamp_inV / m_config->vicon_cache_resolution) : 0;
+  if (use_cache && m_cache_valid && key == m_cache_key) {
+    return;
+  }
+
+  // Get our interpolated pose at the node timestep
+  Eigen::Matrix<double, 6, 6> R_interp;
+  m_cache_has_vicon = m_interpolator->get_pose_with_jacobian(timestamp_inV, m_cache_q_interp, m_cache_p_interp, R_interp, m_cache_H_toff);
+
+  // Find the sqrt inverse to whittening
+  // This is because our measurement noise can change every iteration based on interpolation
+  // NOTE: if we do not have a measurement then we have a zero covariance, so the error will just be zeroed out
+  // NOTE: we invert the lower cholesky factor with a triangular solve (R^-1 = L^-T*L^-1)
+  if (!m_cache_has_vicon) {
+    m_cache_sqrt_inv.setZero();
+  } else {
+    Eigen::LLT<Eigen::Matrix<double, 6, 6>> llt(R_interp);
+    if (llt.info() == Eigen::Success) {
+      m_cache_sqrt_inv = llt.matrixL().solve(Eigen::Matrix<double, 6, 6>::Identity());
+    } else {
+      Eigen::Matrix<double, 6, 6> sqrt_interp = llt.matrixL();
+      m_cache_sqrt_inv = sqrt_interp.colPivHouseholderQr().solve(Eigen::Matrix<double, 6, 6>::Identity());
+    }
+  }
+
+  // Record what we have cached
+  m_cache_key = key;
+  m_cache_valid = use_cache;
+}
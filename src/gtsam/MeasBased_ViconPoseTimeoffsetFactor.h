@@ -19,6 +19,8 @@
 #ifndef GTSAM_VICONPOSETIMEOFFSETFACTOR_H
 #define GTSAM_VICONPOSETIMEOFFSETFACTOR_H
 
+#include <cmath>
+#include <cstdint>
 #include <gtsam/base/debug.h>
 #include <gtsam/base/numericalDerivative.h>
 #include <gtsam/nonlinear/NonlinearFactor.h>
@@ -43,6 +45,19 @@ private:
   std::shared_ptr<Interpolator> m_interpolator; ///< interpolator that has vicon poses in it
   std::shared_ptr<GtsamConfig> m_config;        ///< config file for if we should estimate calibration
 
+  // Our last interpolated measurement, this only depends on the (quantized) vicon query time
+  // Thus if the time offset does not change between linearizations we do not need to interpolate again
+  mutable bool m_cache_valid = false;                   ///< if we have interpolated at least once
+  mutable int64_t m_cache_key = 0;                      ///< quantized query time of our cached measurement
+  mutable bool m_cache_has_vicon = false;               ///< if we had bounding vicon poses at the query time
+  mutable Eigen::Vector4d m_cache_q_interp;             ///< interpolated orientation
+  mutable Eigen::Vector3d m_cache_p_interp;             ///< interpolated position
+  mutable Eigen::Matrix<double, 6, 6> m_cache_sqrt_inv; ///< whitening matrix of the interpolated covariance
+  mutable Eigen::Matrix<double, 6, 1> m_cache_H_toff;   ///< jacobian of the interpolated pose in respect to the time offset
+
+  /// Will interpolate the vicon measurement at the given time, if it is not already the one we have cached
+  void update_cache(double timestamp_inV) const;
+
 public:
   /// Construct from the JPLNavState, calibration, and time offset
   MeasBased_ViconPoseTimeoffsetFactor(Key kstate, Key kR_BtoI, Key kp_BinI, Key kt_off, std::shared_ptr<Interpolator> interpolator,
@@ -0,0 +1,227 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "BagLoader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <geometry_msgs/PoseStamped.h>
+#include <geometry_msgs/TransformStamped.h>
+#include <nav_msgs/Odometry.h>
+#include <ros/ros.h>
+#include <ros/serialization.h>
+#include <sensor_msgs/Imu.h>
+
+#include "utils/parallel.h"
+
+bool BagLoader::load(rosbag::View &view, const std::function<void(const BAGDATA &)> &callback) {
+
+  // Batch of serialized messages, and the same batch once decoded
+  struct RawBatch {
+    size_t id;
+    std::vector<BagDataType> types;
+    std::vector<std::vector<uint8_t>> buffers;
+  };
+  typedef std::vector<BAGDATA, Eigen::aligned_allocator<BAGDATA>> DecodedBatch;
+
+  // Shared state between our reader, decoders, and the calling thread
+  // Batches are numbered in bag order, and we only allow a few of them to be in flight at a time
+  int threads = get_num_threads(num_threads);
+  size_t max_inflight = 4 * (size_t)threads;
+  std::mutex mtx;
+  std::condition_variable cv_raw, cv_decoded, cv_space;
+  std::deque<RawBatch> queue_raw;
+  std::map<size_t, DecodedBatch> queue_decoded;
+  size_t num_read = 0;
+  size_t num_fed = 0;
+  bool done_reading = false;
+  std::atomic<bool> stop(false);
+
+  // Reader, copies out the raw bytes of the messages we want
+  // This is the only thread which touches the bag
+  auto push_batch = [&](RawBatch &batch) {
+    std::unique_lock<std::mutex> lck(mtx);
+    cv_space.wait(lck, [&] { return stop || num_read - num_fed < max_inflight; });
+    batch.id = num_read++;
+    queue_raw.push_back(std::move(batch));
+    cv_raw.notify_one();
+  };
+  std::thread thread_reader([&] {
+    RawBatch batch;
+    for (const rosbag::MessageInstance &m : view) {
+      if (stop)
+        break;
+      BagDataType type = classify(m);
+      if (type == BagDataType::UNKNOWN)
+        continue;
+      batch.types.push_back(type);
+      batch.buffers.emplace_back(m.size());
+      ros::serialization::OStream stream(batch.buffers.back().data(), (uint32_t)batch.buffers.back().size());
+      m.write(stream);
+      if (batch.types.size() >= batch_size) {
+        push_batch(batch);
+        batch = RawBatch();
+      }
+    }
+    if (!batch.types.empty())
+      push_batch(batch);
+    std::lock_guard<std::mutex> lck(mtx);
+    done_reading = true;
+    cv_raw.notify_all();
+    cv_decoded.notify_all();
+  });
+
+  // Decoders, deserialize batches in whatever order they get them
+  std::vector<std::thread> thread_decoders;
+  for (int t = 0; t < threads; t++) {
+    thread_decoders.emplace_back([&] {
+      while (true) {
+        RawBatch batch;
+        {
+          std::unique_lock<std::mutex> lck(mtx);
+          cv_raw.wait(lck, [&] { return stop || done_reading || !queue_raw.empty(); });
+          if (stop || queue_raw.empty())
+            return;
+          batch = std::move(queue_raw.front());
+          queue_raw.pop_front();
+        }
+        Profiler::Scope timer_decode(profiler, "bag_decode_batch");
+        DecodedBatch decoded(batch.types.size());
+        for (size_t i = 0; i < batch.types.size(); i++) {
+          decode(batch.types.at(i), batch.buffers.at(i), decoded.at(i));
+        }
+        timer_decode.stop();
+        std::lock_guard<std::mutex> lck(mtx);
+        queue_decoded.insert({batch.id, std::move(decoded)});
+        cv_decoded.notify_all();
+      }
+    });
+  }
+
+  // Finally give the decoded measurements to the caller in bag order
+  bool success = true;
+  while (true) {
+    DecodedBatch decoded;
+    {
+      std::unique_lock<std::mutex> lck(mtx);
+      cv_decoded.wait(lck, [&] { return queue_decoded.find(num_fed) != queue_decoded.end() || (done_reading && num_fed == num_read); });
+      if (queue_decoded.find(num_fed) == queue_decoded.end())
+        break;
+      decoded = std::move(queue_decoded.at(num_fed));
+      queue_decoded.erase(num_fed);
+    }
+    if (!ros::ok()) {
+      success = false;
+      break;
+    }
+    for (const BAGDATA &data : decoded) {
+      callback(data);
+    }
+    std::lock_guard<std::mutex> lck(mtx);
+    num_fed++;
+    cv_space.notify_all();
+  }
+
+  // Stop all our threads (they will have already finished if we loaded everything)
+  {
+    std::lock_guard<std::mutex> lck(mtx);
+    stop = true;
+    cv_raw.notify_all();
+    cv_space.notify_all();
+  }
+  thread_reader.join();
+  for (auto &thread : thread_decoders) {
+    thread.join();
+  }
+  return success;
+}
+
+BagDataType BagLoader::classify(const rosbag::MessageInstance &m) const {
+  const std::string &topic = m.getTopic();
+  const std::string &datatype = m.getDataType();
+  if (topic == topic_imu && datatype == ros::message_traits::datatype<sensor_msgs::Imu>())
+    return BagDataType::IMU;
+  if (topic != topic_vicon)
+    return BagDataType::UNKNOWN;
+  if (datatype == ros::message_traits::datatype<nav_msgs::Odometry>())
+    return BagDataType::VICON_ODOM;
+  if (datatype == ros::message_traits::datatype<geometry_msgs::TransformStamped>())
+    return BagDataType::VICON_TRANSFORM;
+  if (datatype == ros::message_traits::datatype<geometry_msgs::PoseStamped>())
+    return BagDataType::VICON_POSE;
+  return BagDataType::UNKNOWN;
+}
+
+void BagLoader::decode(BagDataType type, std::vector<uint8_t> &buffer, BAGDATA &data) {
+
+  // Our stream we will read the message from
+  data.type = type;
+  ros::serialization::IStream stream(buffer.data(), (uint32_t)buffer.size());
+
+  // Handle IMU messages
+  if (type == BagDataType::IMU) {
+    sensor_msgs::Imu msg;
+    ros::serialization::deserialize(stream, msg);
+    data.timestamp = msg.header.stamp.toSec();
+    data.wm << msg.angular_velocity.x, msg.angular_velocity.y, msg.angular_velocity.z;
+    data.am << msg.linear_acceleration.x, msg.linear_acceleration.y, msg.linear_acceleration.z;
+    return;
+  }
+
+  // Handle VICON messages
+  if (type == BagDataType::VICON_ODOM) {
+    nav_msgs::Odometry msg;
+    ros::serialization::deserialize(stream, msg);
+    data.timestamp = msg.header.stamp.toSec();
+    data.q << msg.pose.pose.orientation.x, msg.pose.pose.orientation.y, msg.pose.pose.orientation.z, msg.pose.pose.orientation.w;
+    data.p << msg.pose.pose.position.x, msg.pose.pose.position.y, msg.pose.pose.position.z;
+    // load the covariance of the pose (order=x,y,z,rx,ry,rz) stored row-major
+    for (size_t c = 0; c < 6; c++) {
+      for (size_t r = 0; r < 6; r++) {
+        data.pose_cov(r, c) = msg.pose.covariance[6 * c + r];
+      }
+    }
+    return;
+  }
+
+  // Handle VICON messages
+  if (type == BagDataType::VICON_TRANSFORM) {
+    geometry_msgs::TransformStamped msg;
+    ros::serialization::deserialize(stream, msg);
+    data.timestamp = msg.header.stamp.toSec();
+    data.q << msg.transform.rotation.x, msg.transform.rotation.y, msg.transform.rotation.z, msg.transform.rotation.w;
+    data.p << msg.transform.translation.x, msg.transform.translation.y, msg.transform.translation.z;
+    return;
+  }
+
+  // Handle VICON messages
+  if (type == BagDataType::VICON_POSE) {
+    geometry_msgs::PoseStamped msg;
+    ros::serialization::deserialize(stream, msg);
+    data.timestamp = msg.header.stamp.toSec();
+    data.q << msg.pose.orientation.x, msg.pose.orientation.y, msg.pose.orientation.z, msg.pose.orientation.w;
+    data.p << msg.pose.position.x, msg.pose.position.y, msg.pose.position.z;
+    return;
+  }
+}
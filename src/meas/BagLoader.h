@@ -0,0 +1,103 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef BAGLOADER_H
+#define BAGLOADER_H
+
+#include <Eigen/Eigen>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+#include "utils/profiler.h"
+
+/// Type of message we have decoded from the bag
+enum class BagDataType { UNKNOWN, IMU, VICON_ODOM, VICON_TRANSFORM, VICON_POSE };
+
+struct BAGDATA {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  BagDataType type = BagDataType::UNKNOWN;
+  double timestamp = -1;
+  Eigen::Vector3d wm;                   // imu angular velocity
+  Eigen::Vector3d am;                   // imu linear acceleration
+  Eigen::Vector4d q;                    // vicon orientation (x,y,z,w)
+  Eigen::Vector3d p;                    // vicon position
+  Eigen::Matrix<double, 6, 6> pose_cov; // vicon covariance (order=x,y,z,rx,ry,rz), only for odometry
+};
+
+/**
+ * @brief Loads IMU and vicon messages from a rosbag using a pool of threads.
+ *
+ * A reader thread steps through the bag and copies out the serialized bytes of the messages we want.
+ * We dispatch on the topic and datatype, so we never try to deserialize a message into the wrong type.
+ * These are grouped into batches and given to worker threads to deserialize.
+ * The decoded batches are then handed back to the calling thread in bag order.
+ * The number of batches in flight is bounded, so we do not load the whole bag into memory if decoding can't keep up.
+ */
+class BagLoader {
+
+public:
+  /**
+   * @brief Default constructor
+   * @param topic_imu Topic of our IMU messages
+   * @param topic_vicon Topic of our vicon messages (odometry, transform, or pose stamped)
+   * @param num_threads Number of threads we will decode with
+   * @param profiler Profiler we will record the decoding time of each batch into (can be null)
+   * @param batch_size Number of messages in each batch given to a worker
+   */
+  BagLoader(std::string topic_imu, std::string topic_vicon, int num_threads, std::shared_ptr<Profiler> profiler = nullptr,
+            size_t batch_size = 1024)
+      : topic_imu(topic_imu), topic_vicon(topic_vicon), num_threads(num_threads), batch_size(batch_size), profiler(profiler) {}
+
+  /**
+   * @brief Decode all messages in the view.
+   *
+   * The callback is only ever called from the calling thread, in the same order as the messages are in the bag.
+   * Thus it is safe to feed the propagator and interpolator from it.
+   *
+   * @param view View of the bag we want to load
+   * @param callback Function which will be called on each decoded message
+   * @return False if we stopped early (i.e. ros is shutting down)
+   */
+  bool load(rosbag::View &view, const std::function<void(const BAGDATA &)> &callback);
+
+private:
+  /// Gets what type of measurement a message is, without deserializing it
+  BagDataType classify(const rosbag::MessageInstance &m) const;
+
+  /// Deserializes a message into our measurement
+  static void decode(BagDataType type, std::vector<uint8_t> &buffer, BAGDATA &data);
+
+  // Topics we want to load
+  std::string topic_imu;
+  std::string topic_vicon;
+
+  // Number of worker threads and messages in each batch
+  int num_threads;
+  size_t batch_size;
+
+  // Timing of each batch we decode
+  std::shared_ptr<Profiler> profiler;
+};
+
+#endif /* BAGLOADER_H */
@@ -20,17 +20,17 @@
 
 void Interpolator::feed_pose(double timestamp, Eigen::Vector4d q, Eigen::Vector3d p, Eigen::Matrix3d R_q, Eigen::Matrix3d R_p) {
 
-  // Create our imu data object
-  POSEDATA data;
-  data.timestamp = timestamp;
-  data.has_odom = false;
-  data.q = q;
-  data.p = p;
-  data.R_q = R_q;
-  data.R_p = R_p;
-
-  // Append it to our vector
-  pose_data.insert(data);
+  // Check if we are still in order (i.e. don't need to sort when sealing)
+  if (!timestamps.empty() && timestamps.back() >= timestamp) {
+    sealed = false;
+  }
+
+  // Append it to our arrays
+  timestamps.push_back(timestamp);
+  quats.push_back(q);
+  positions.push_back(p);
+  covs_q.push_back(R_q);
+  covs_p.push_back(R_p);
 
   // Update our times
   time_min = std::min(time_min, timestamp);
@@ -39,103 +39,142 @@ void Interpolator::feed_pose(double timestamp, Eigen::Vector4d q, Eigen::Vector3
 
 void Interpolator::feed_odom(double timestamp, Eigen::Vector4d q, Eigen::Vector3d p, Eigen::Vector3d v, Eigen::Vector3d w,
                              Eigen::Matrix3d R_q, Eigen::Matrix3d R_p, Eigen::Matrix3d R_v, Eigen::Matrix3d R_w) {
+  feed_pose(timestamp, q, p, R_q, R_p);
+}
+
+void Interpolator::seal() {
 
-  // Create our imu data object
-  POSEDATA data;
-  data.timestamp = timestamp;
-  data.has_odom = true;
-  data.q = q;
-  data.p = p;
-  data.v = v;
-  data.w = w;
-  data.R_q = R_q;
-  data.R_p = R_p;
-  data.R_v = R_v;
-  data.R_w = R_w;
-
-  // Append it to our vector
-  pose_data.insert(data);
+  // Nothing to do if we are already sorted
+  if (sealed)
+    return;
+
+  // Sort the indices by time, stable such that duplicates stay in the order they where fed
+  std::vector<size_t> order(timestamps.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order.at(i) = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return timestamps.at(a) < timestamps.at(b); });
+
+  // Remove duplicate timestamps, only the first one fed is kept
+  order.erase(std::unique(order.begin(), order.end(), [&](size_t a, size_t b) { return timestamps.at(a) == timestamps.at(b); }),
+              order.end());
+
+  // Finally rebuild our arrays in this order
+  std::vector<double> timestamps_sorted;
+  std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d>> quats_sorted;
+  std::vector<Eigen::Vector3d> positions_sorted;
+  std::vector<Eigen::Matrix3d> covs_q_sorted, covs_p_sorted;
+  timestamps_sorted.reserve(order.size());
+  quats_sorted.reserve(order.size());
+  positions_sorted.reserve(order.size());
+  covs_q_sorted.reserve(order.size());
+  covs_p_sorted.reserve(order.size());
+  for (size_t idx : order) {
+    timestamps_sorted.push_back(timestamps.at(idx));
+    quats_sorted.push_back(quats.at(idx));
+    positions_sorted.push_back(positions.at(idx));
+    covs_q_sorted.push_back(covs_q.at(idx));
+    covs_p_sorted.push_back(covs_p.at(idx));
+  }
+  timestamps.swap(timestamps_sorted);
+  quats.swap(quats_sorted);
+  positions.swap(positions_sorted);
+  covs_q.swap(covs_q_sorted);
+  covs_p.swap(covs_p_sorted);
+  sealed = true;
 }
 
-bool Interpolator::get_pose(double timestamp, Eigen::Vector4d &q, Eigen::Vector3d &p, Eigen::Matrix<double, 6, 6> &R) {
+bool Interpolator::find_bounds(double timestamp, size_t &idx0, size_t &idx1, bool &at_begin) const {
+
+  // Ensure that we have been sorted
+  assert(sealed);
 
   // Find our bounds for the desired timestamp
-  POSEDATA pose_to_find;
-  pose_to_find.timestamp = timestamp;
-  auto bounds = pose_data.equal_range(pose_to_find);
+  size_t lower = search_timestamps(timestamp, false);
+  size_t upper = search_timestamps(timestamp, true);
+  at_begin = (lower == 0);
+
+  // Return false if we do not have any bounding pose for this measurement
+  if (at_begin || lower == timestamps.size() || upper == timestamps.size()) {
+    return false;
+  }
+  idx0 = lower - 1;
+  idx1 = upper;
+  return true;
+}
+
+bool Interpolator::get_pose(double timestamp, Eigen::Vector4d &q, Eigen::Vector3d &p, Eigen::Matrix<double, 6, 6> &R) const {
+
+  // Find our bounds for the desired timestamp
+  size_t idx0, idx1;
+  bool at_begin;
+  bool has_bounds = find_bounds(timestamp, idx0, idx1, at_begin);
 
   // Best we can do at the beginning is just the first vicon pose
-  if (bounds.first == pose_data.begin()) {
-    // our pose
-    // POSEDATA poseEXACT = *bounds.first;
+  if (at_begin) {
     // mean values
-    q << 0, 0, 0, 1; //= poseEXACT.q;
-    p << 0, 0, 0;    //= poseEXACT.p;
+    q << 0, 0, 0, 1; //= quats.at(0);
+    p << 0, 0, 0;    //= positions.at(0);
     // meas covariance
     R.setZero();
-    // R.block(0,0,3,3) = poseEXACT.R_q;
-    // R.block(3,3,3,3) = poseEXACT.R_p;
+    // R.block(0,0,3,3) = covs_q.at(0);
+    // R.block(3,3,3,3) = covs_p.at(0);
     return false;
   }
 
   // Return false if we do not have any bounding pose for this measurement (shouldn't happen)
-  if (bounds.first == pose_data.end() || bounds.second == pose_data.end()) {
-    // our pose
-    // POSEDATA poseEXACT = *(--bounds.first);
+  if (!has_bounds) {
     // mean values
-    q << 0, 0, 0, 1; //= poseEXACT.q;
-    p << 0, 0, 0;    //= poseEXACT.p;
+    q << 0, 0, 0, 1; //= quats.back();
+    p << 0, 0, 0;    //= positions.back();
     // meas covariance
     R.setZero();
-    // R.block(0,0,3,3) = poseEXACT.R_q;
-    // R.block(3,3,3,3) = poseEXACT.R_p;
-    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES, %d, %d",bounds.first==pose_data.end(),bounds.second==pose_data.end());
+    // R.block(0,0,3,3) = covs_q.back();
+    // R.block(3,3,3,3) = covs_p.back();
+    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES");
     // ROS_ERROR("[INTER]: tmeas = %.9f | time0 = %.9f | time1 = %.9f", timestamp, time0, time1);
     return false;
   }
-  bounds.first--;
 
   // If we found an exact one, just return that
-  if (bounds.first->timestamp == bounds.second->timestamp) {
-    // our pose
-    POSEDATA poseEXACT = *bounds.first;
+  if (timestamps[idx0] == timestamps[idx1]) {
     // mean values
-    q = poseEXACT.q;
-    p = poseEXACT.p;
+    q = quats[idx0];
+    p = positions[idx0];
     // meas covariance
     R.setZero();
-    R.block(0, 0, 3, 3) = poseEXACT.R_q;
-    R.block(3, 3, 3, 3) = poseEXACT.R_p;
+    R.block(0, 0, 3, 3) = covs_q[idx0];
+    R.block(3, 3, 3, 3) = covs_p[idx0];
     return true;
   }
 
   // Else set our bounds as the bounds our binary search found
-  POSEDATA pose0 = *bounds.first;
-  POSEDATA pose1 = *bounds.second;
+  double time0 = timestamps[idx0];
+  double time1 = timestamps[idx1];
 
   // Return failure if the poses are too far away
   // NOTE: Right now we just say that the poses need to be at least 5 seconds away
   // NOTE: This might cause failure if low frequency vicon rates, but 5 second is pretty slow...
   // NOTE: The pose estimate is only really used for initial guess, we will be stricter on accepting info for the factor...
   double thresh_sec = 5.0;
-  if (std::abs(timestamp - pose0.timestamp) > thresh_sec || std::abs(timestamp - pose1.timestamp) > thresh_sec) {
-    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES, %d, %d", bounds.first == pose_data.end(), bounds.second == pose_data.end());
-    // ROS_ERROR("[INTER]: tmeas = %.9f | time0 = %.9f | time1 = %.9f", timestamp, pose0.timestamp, pose1.timestamp);
+  if (std::abs(timestamp - time0) > thresh_sec || std::abs(timestamp - time1) > thresh_sec) {
+    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES");
+    // ROS_ERROR("[INTER]: tmeas = %.9f | time0 = %.9f | time1 = %.9f", timestamp, time0, time1);
     return false;
   }
 
   // Our lamda time-distance fraction
-  double lambda = (timestamp - pose0.timestamp) / (pose1.timestamp - pose0.timestamp);
+  double lambda = (timestamp - time0) / (time1 - time0);
 
   // Bounding SO(3) orientations
-  Eigen::Matrix3d R_Gto0 = quat_2_Rot(pose0.q);
-  Eigen::Matrix3d R_Gto1 = quat_2_Rot(pose1.q);
+  Eigen::Matrix3d R_Gto0 = quat_2_Rot(quats[idx0]);
+  Eigen::Matrix3d R_Gto1 = quat_2_Rot(quats[idx1]);
 
   // Now perform the interpolation
   Eigen::Matrix3d R_0to1 = R_Gto1 * R_Gto0.transpose();
   Eigen::Matrix3d R_0toi = exp_so3(lambda * log_so3(R_0to1));
   Eigen::Matrix3d R_interp = R_0toi * R_Gto0;
-  Eigen::Vector3d p_interp = (1 - lambda) * pose0.p + lambda * pose1.p;
+  Eigen::Vector3d p_interp = (1 - lambda) * positions[idx0] + lambda * positions[idx1];
 
   // Calculate intermediate values for cov propagation equations
   // Equation (8)-(10) of Geneva2018ICRA async measurement paper
@@ -157,10 +196,10 @@ bool Interpolator::get_pose(double timestamp, Eigen::Vector4d &q, Eigen::Vector3
 
   // Finally propagate the covariance!
   Eigen::Matrix<double, 12, 12> R_12 = Eigen::Matrix<double, 12, 12>::Zero();
-  R_12.block(0, 0, 3, 3) = pose0.R_q;
-  R_12.block(3, 3, 3, 3) = pose0.R_p;
-  R_12.block(6, 6, 3, 3) = pose1.R_q;
-  R_12.block(9, 9, 3, 3) = pose1.R_p;
+  R_12.block(0, 0, 3, 3) = covs_q[idx0];
+  R_12.block(3, 3, 3, 3) = covs_p[idx0];
+  R_12.block(6, 6, 3, 3) = covs_q[idx1];
+  R_12.block(9, 9, 3, 3) = covs_p[idx1];
   R = Hu * R_12 * Hu.transpose();
 
   // Done
@@ -170,84 +209,77 @@ bool Interpolator::get_pose(double timestamp, Eigen::Vector4d &q, Eigen::Vector3
 }
 
 bool Interpolator::get_pose_with_jacobian(double timestamp, Eigen::Vector4d &q, Eigen::Vector3d &p, Eigen::Matrix<double, 6, 6> &R,
-                                          Eigen::Matrix<double, 6, 1> &H_toff) {
+                                          Eigen::Matrix<double, 6, 1> &H_toff) const {
 
   // Find our bounds for the desired timestamp
-  POSEDATA pose_to_find;
-  pose_to_find.timestamp = timestamp;
-  auto bounds = pose_data.equal_range(pose_to_find);
+  size_t idx0, idx1;
+  bool at_begin;
+  bool has_bounds = find_bounds(timestamp, idx0, idx1, at_begin);
 
   // Best we can do at the beginning is just the first vicon pose
-  if (bounds.first == pose_data.begin()) {
-    // our pose
-    // POSEDATA poseEXACT = *bounds.first;
+  if (at_begin) {
     // mean values
-    q << 0, 0, 0, 1; //= poseEXACT.q;
-    p << 0, 0, 0;    //= poseEXACT.p;
+    q << 0, 0, 0, 1; //= quats.at(0);
+    p << 0, 0, 0;    //= positions.at(0);
     // meas covariance
     R.setZero();
-    // R.block(0,0,3,3) = poseEXACT.R_q;
-    // R.block(3,3,3,3) = poseEXACT.R_p;
+    // R.block(0,0,3,3) = covs_q.at(0);
+    // R.block(3,3,3,3) = covs_p.at(0);
     return false;
   }
 
   // Return false if we do not have any bounding pose for this measurement (shouldn't happen)
-  if (bounds.first == pose_data.end() || bounds.second == pose_data.end()) {
-    // our pose
-    // POSEDATA poseEXACT = *(--bounds.first);
+  if (!has_bounds) {
     // mean values
-    q << 0, 0, 0, 1; //= poseEXACT.q;
-    p << 0, 0, 0;    //= poseEXACT.p;
+    q << 0, 0, 0, 1; //= quats.back();
+    p << 0, 0, 0;    //= positions.back();
     // meas covariance
     R.setZero();
-    // R.block(0,0,3,3) = poseEXACT.R_q;
-    // R.block(3,3,3,3) = poseEXACT.R_p;
-    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES, %d, %d",bounds.first==pose_data.end(),bounds.second==pose_data.end());
+    // R.block(0,0,3,3) = covs_q.back();
+    // R.block(3,3,3,3) = covs_p.back();
+    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES");
     // ROS_ERROR("[INTER]: tmeas = %.9f | time0 = %.9f | time1 = %.9f", timestamp, time0, time1);
     return false;
   }
-  bounds.first--;
 
   // If we found an exact one, just return that
-  if (bounds.first->timestamp == bounds.second->timestamp) {
-    // our pose
-    POSEDATA poseEXACT = *bounds.first;
+  if (timestamps[idx0] == timestamps[idx1]) {
     // mean values
-    q = poseEXACT.q;
-    p = poseEXACT.p;
+    q = quats[idx0];
+    p = positions[idx0];
     // meas covariance
     R.setZero();
-    R.block(0, 0, 3, 3) = poseEXACT.R_q;
-    R.block(3, 3, 3, 3) = poseEXACT.R_p;
+    R.block(0, 0, 3, 3) = covs_q[idx0];
+    R.block(3, 3, 3, 3) = covs_p[idx0];
     return true;
   }
 
   // Else set our bounds as the bounds our binary search found
-  POSEDATA pose0 = *bounds.first;
-  POSEDATA pose1 = *bounds.second;
+  double time0 = timestamps[idx0];
+  double time1 = timestamps[idx1];
 
   // Return failure if the poses are too far away
   // NOTE: this is more strict since we don't want to use vicon measurements that are too far away (5hz)
   // NOTE: the factor will not add any information if we return false, so this is ok to be stricter here...
   double thresh_sec = 0.1;
-  if (std::abs(timestamp - pose0.timestamp) > thresh_sec || std::abs(timestamp - pose1.timestamp) > thresh_sec) {
-    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES, %d, %d", bounds.first == pose_data.end(), bounds.second == pose_data.end());
-    // ROS_ERROR("[INTER]: tmeas = %.9f | time0 = %.9f | time1 = %.9f", timestamp, pose0.timestamp, pose1.timestamp);
+  if (std::abs(timestamp - time0) > thresh_sec || std::abs(timestamp - time1) > thresh_sec) {
+    // ROS_ERROR("[INTER]: UNABLE TO FIND BOUNDING POSES");
+    // ROS_ERROR("[INTER]: tmeas = %.9f | time0 = %.9f | time1 = %.9f", timestamp, time0, time1);
     return false;
   }
 
   // Our lamda time-distance fraction
-  double lambda = (timestamp - pose0.timestamp) / (pose1.timestamp - pose0.timestamp);
+  double lambda = (timestamp - time0) / (time1 - time0);
 
   // Bounding SO(3) orientations
-  Eigen::Matrix3d R_Gto0 = quat_2_Rot(pose0.q);
-  Eigen::Matrix3d R_Gto1 = quat_2_Rot(pose1.q);
+  Eigen::Matrix3d R_Gto0 = quat_2_Rot(quats[idx0]);
+  Eigen::Matrix3d R_Gto1 = quat_2_Rot(quats[idx1]);
 
   // Now perform the interpolation
   Eigen::Matrix3d R_0to1 = R_Gto1 * R_Gto0.transpose();
   Eigen::Matrix3d R_0toi = exp_so3(lambda * log_so3(R_0to1));
   Eigen::Matrix3d R_interp = R_0toi * R_Gto0;
-  Eigen::Vector3d p_interp = (1 - lambda) * pose0.p + lambda * pose1.p;
+  Eigen::Vector3d p_interp = (1 - lambda) * positions[idx0] + lambda * positions[idx1];
 
   // Calculate intermediate values for cov propagation equations
   // Equation (8)-(10) of Geneva2018ICRA async measurement paper
@@ -269,17 +301,17 @@ bool Interpolator::get_pose_with_jacobian(double timestamp, Eigen::Vector4d &q,
 
   // Finally propagate the covariance!
   Eigen::Matrix<double, 12, 12> R_12 = Eigen::Matrix<double, 12, 12>::Zero();
-  R_12.block(0, 0, 3, 3) = pose0.R_q;
-  R_12.block(3, 3, 3, 3) = pose0.R_p;
-  R_12.block(6, 6, 3, 3) = pose1.R_q;
-  R_12.block(9, 9, 3, 3) = pose1.R_p;
+  R_12.block(0, 0, 3, 3) = covs_q[idx0];
+  R_12.block(3, 3, 3, 3) = covs_p[idx0];
+  R_12.block(6, 6, 3, 3) = covs_q[idx1];
+  R_12.block(9, 9, 3, 3) = covs_p[idx1];
   R = Hu * R_12 * Hu.transpose();
 
   // Jacobian in respect to our time offset
-  double H_lambda2toff = -1.0 / (pose1.timestamp - pose0.timestamp);
+  double H_lambda2toff = -1.0 / (time1 - time0);
   H_toff.setZero();
   H_toff.block(0, 0, 3, 1) = -R_0toi * JR_r0i * log_so3(R_0to1) * H_lambda2toff;
-  H_toff.block(3, 0, 3, 1) = (pose1.p - pose0.p) * H_lambda2toff;
+  H_toff.block(3, 0, 3, 1) = (positions[idx1] - positions[idx0]) * H_lambda2toff;
 
   // Done
   q = rot_2_quat(R_interp);
@@ -288,40 +320,66 @@ bool Interpolator::get_pose_with_jacobian(double timestamp, Eigen::Vector4d &q,
 }
 
 bool Interpolator::get_bounds(double timestamp, double &time0, Eigen::Vector4d &q0, Eigen::Vector3d &p0, Eigen::Matrix<double, 6, 6> &R0,
-                              double &time1, Eigen::Vector4d &q1, Eigen::Vector3d &p1, Eigen::Matrix<double, 6, 6> &R1) {
+                              double &time1, Eigen::Vector4d &q1, Eigen::Vector3d &p1, Eigen::Matrix<double, 6, 6> &R1) const {
 
   // Find our bounds for the desired timestamp
-  POSEDATA pose_to_find;
-  pose_to_find.timestamp = timestamp;
-  auto bounds = pose_data.equal_range(pose_to_find);
-
   // Return false if we do not have any bounding pose for this measurement (shouldn't happen)
-  if (bounds.first == pose_data.begin() || bounds.first == pose_data.end() || bounds.second == pose_data.end()) {
-    // ROS_ERROR("[INTERPOLATOR]: UNABLE TO FIND BOUNDING POSES, %d, %d",bounds.first==pose_data.end(),bounds.second==pose_data.end());
+  size_t idx0, idx1;
+  bool at_begin;
+  if (!find_bounds(timestamp, idx0, idx1, at_begin)) {
+    // ROS_ERROR("[INTERPOLATOR]: UNABLE TO FIND BOUNDING POSES");
     // ROS_ERROR("[INTERPOLATOR]: tmeas = %.9f | time0 = %.9f | time1 = %.9f", timestamp, time0, time1);
     return false;
   }
-  bounds.first--;
-
-  // Else set our bounds as the bounds our binary search found
-  POSEDATA pose0 = *bounds.first;
-  POSEDATA pose1 = *bounds.second;
 
   // Pose 0
-  time0 = pose0.timestamp;
-  q0 = pose0.q;
-  p0 = pose0.p;
+  time0 = timestamps[idx0];
+  q0 = quats[idx0];
+  p0 = positions[idx0];
   R0.setZero();
-  R0.block(0, 0, 3, 3) = pose0.R_q;
-  R0.block(3, 3, 3, 3) = pose0.R_p;
+  R0.block(0, 0, 3, 3) = covs_q[idx0];
+  R0.block(3, 3, 3, 3) = covs_p[idx0];
 
   // Pose 1
-  time1 = pose1.timestamp;
-  q1 = pose1.q;
-  p1 = pose1.p;
+  time1 = timestamps[idx1];
+  q1 = quats[idx1];
+  p1 = positions[idx1];
   R1.setZero();
-  R1.block(0, 0, 3, 3) = pose1.R_q;
-  R1.block(3, 3, 3, 3) = pose1.R_p;
+  R1.block(0, 0, 3, 3) = covs_q[idx1];
+  R1.block(3, 3, 3, 3) = covs_p[idx1];
 
   return true;
 }
+
+double Interpolator::get_max_gap(double time0, double time1) const {
+  assert(sealed);
+  if (timestamps.empty())
+    return time1 - time0;
+
+  // Time outside of our poses
+  double gap = 0.0;
+  if (time0 < timestamps.front())
+    gap = std::max(gap, std::min(time1, timestamps.front()) - time0);
+  if (time1 > timestamps.back())
+    gap = std::max(gap, time1 - std::max(time0, timestamps.back()));
+
+  // Start at the pose before the period, and check each pair until we are past it
+  size_t idx = search_timestamps(time0, false);
+  idx = (idx > 0) ? idx - 1 : 0;
+  for (; idx + 1 < timestamps.size() && timestamps.at(idx) < time1; idx++) {
+    gap = std::max(gap, timestamps.at(idx + 1) - timestamps.at(idx));
+  }
+  return gap;
+}
+
+double Interpolator::get_median_period() const {
+  assert(sealed);
+  if (timestamps.size() < 2)
+    return 0.0;
+  std::vector<double> periods(timestamps.size() - 1);
+  for (size_t i = 0; i + 1 < timestamps.size(); i++) {
+    periods.at(i) = timestamps.at(i + 1) - timestamps.at(i);
+  }
+  std::nth_element(periods.begin(), periods.begin() + periods.size() / 2, periods.end());
+  return periods.at(periods.size() / 2);
+}
@@ -27,24 +27,6 @@
 #include "cpi/CpiV1.h"
 #include "utils/quat_ops.h"
 
-struct POSEDATA {
-  double timestamp = -1;
-  bool has_odom = false;
-  // ori, pos, vel, ang
-  Eigen::Vector4d q;
-  Eigen::Vector3d p;
-  Eigen::Vector3d v;
-  Eigen::Vector3d w;
-  // noise covariances
-  Eigen::Matrix3d R_q;
-  Eigen::Matrix3d R_p;
-  Eigen::Matrix3d R_v;
-  Eigen::Matrix3d R_w;
-  // Comparison operator
-  bool operator<(const POSEDATA &s) const { return timestamp < s.timestamp; }
-  bool operator>(const POSEDATA &s) const { return timestamp > s.timestamp; }
-};
-
 class Interpolator {
 
 public:
@@ -55,35 +37,107 @@ public:
   void feed_pose(double timestamp, Eigen::Vector4d q, Eigen::Vector3d p, Eigen::Matrix3d R_q, Eigen::Matrix3d R_p);
 
   /// Our feed function for ODOM measurements
+  /// Note that only the pose and its covariance is used for interpolation, thus velocities are not stored
   void feed_odom(double timestamp, Eigen::Vector4d q, Eigen::Vector3d p, Eigen::Vector3d v, Eigen::Vector3d w, Eigen::Matrix3d R_q,
                  Eigen::Matrix3d R_p, Eigen::Matrix3d R_v, Eigen::Matrix3d R_w);
 
+  /**
+   * @brief This will sort all fed poses by time and remove duplicate timestamps (keeping the first one fed).
+   *
+   * This needs to be called after all poses have been fed and before any of the getter functions are used.
+   * Once sealed, the getter functions do not modify the interpolator and are safe to call from multiple threads.
+   */
+  void seal();
+
   /// Given a timestamp, this will get the pose at that time
   /// If we don't have that pose in our vector, we will perform interpolation to get it
-  bool get_pose(double timestamp, Eigen::Vector4d &q, Eigen::Vector3d &p, Eigen::Matrix<double, 6, 6> &R);
+  bool get_pose(double timestamp, Eigen::Vector4d &q, Eigen::Vector3d &p, Eigen::Matrix<double, 6, 6> &R) const;
 
   /// Given a timestamp, this will get the pose at that time
   /// If we don't have that pose in our vector, we will perform interpolation to get it
   bool get_pose_with_jacobian(double timestamp, Eigen::Vector4d &q, Eigen::Vector3d &p, Eigen::Matrix<double, 6, 6> &R,
-                              Eigen::Matrix<double, 6, 1> &H_toff);
+                              Eigen::Matrix<double, 6, 1> &H_toff) const;
 
   /// Given a timestamp, this will find the bounding poses for them
   bool get_bounds(double timestamp, double &time0, Eigen::Vector4d &q0, Eigen::Vector3d &p0, Eigen::Matrix<double, 6, 6> &R0, double &time1,
-                  Eigen::Vector4d &q1, Eigen::Vector3d &p1, Eigen::Matrix<double, 6, 6> &R1);
-
-  /// Get all raw poses (used only for viz)
-  std::set<POSEDATA, std::less<POSEDATA>> get_raw_poses() { return pose_data; }
+                  Eigen::Vector4d &q1, Eigen::Vector3d &p1, Eigen::Matrix<double, 6, 6> &R1) const;
+
+  /// Number of raw poses we have
+  size_t get_num_poses() const { return timestamps.size(); }
+
+  /// Get a raw pose by its index in time (used only for viz)
+  void get_raw_pose(size_t index, double &timestamp, Eigen::Vector4d &q, Eigen::Vector3d &p) const {
+    timestamp = timestamps.at(index);
+    q = quats.at(index);
+    p = positions.at(index);
+  }
+
+  /**
+   * @brief Gets the largest time between two consecutive poses which overlaps the given period (i.e. a dropout of the vicon)
+   * Time in the period before our first or after our last pose also counts as a gap.
+   * @param time0 Start of the period
+   * @param time1 End of the period
+   * @return Length of the largest gap in seconds
+   */
+  double get_max_gap(double time0, double time1) const;
+
+  /// Median time between two consecutive poses (i.e. the nominal vicon period), zero if we have less than two poses
+  double get_median_period() const;
 
   /// Oldest pose reading we have
-  double get_time_min() { return time_min; }
+  double get_time_min() const { return time_min; }
 
   /// Newest pose reading we have
-  double get_time_max() { return time_max; }
+  double get_time_max() const { return time_max; }
 
 private:
-  // Our history of POSE messages (time, ori, pos, vel, ang)
-  // Note that this is sorted by timestamps so we can binary search through it....
-  std::set<POSEDATA, std::less<POSEDATA>> pose_data;
+  /**
+   * @brief Finds the indices of the two poses which bound the requested timestamp.
+   *
+   * This mirrors a std::equal_range() on the sorted timestamps, with the lower bound stepped back one.
+   * Thus pose0 is the last pose strictly before the timestamp, and pose1 is the first pose strictly after.
+   *
+   * @param timestamp Time we want to find the bounds of
+   * @param[out] idx0 Index of the pose before
+   * @param[out] idx1 Index of the pose after
+   * @param[out] at_begin True if there are no poses before the timestamp
+   * @return False if we do not have a pose on both sides
+   */
+  bool find_bounds(double timestamp, size_t &idx0, size_t &idx1, bool &at_begin) const;
+
+  /// Branch-free binary search, returns the first index with a timestamp not less than (or greater than if upper) the requested time
+  size_t search_timestamps(double timestamp, bool upper) const {
+    size_t n = timestamps.size();
+    if (n == 0)
+      return 0;
+    const double *data = timestamps.data();
+    const double *base = data;
+    if (upper) {
+      while (n > 1) {
+        size_t half = n / 2;
+        base = (base[half] <= timestamp) ? base + half : base;
+        n -= half;
+      }
+      return (base - data) + (*base <= timestamp);
+    }
+    while (n > 1) {
+      size_t half = n / 2;
+      base = (base[half] < timestamp) ? base + half : base;
+      n -= half;
+    }
+    return (base - data) + (*base < timestamp);
+  }
+
+  // Our history of POSE messages (time, ori, pos, and their covariance)
+  // This is stored as separate arrays, which are sorted by timestamps in seal() so we can binary search through it....
+  std::vector<double> timestamps;
+  std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d>> quats;
+  std::vector<Eigen::Vector3d> positions;
+  std::vector<Eigen::Matrix3d> covs_q;
+  std::vector<Eigen::Matrix3d> covs_p;
+
+  // If our arrays are sorted and do not have duplicates
+  bool sealed = true;
 
   double time_min = INFINITY;
   double time_max = -INFINITY;
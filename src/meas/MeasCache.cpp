@@ -0,0 +1,171 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "MeasCache.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+// Magic string at the start of each file
+static const char CACHE_MAGIC[8] = {'V', '2', 'G', 'T', 'C', 'A', 'C', 'H'};
+
+uint64_t MeasCache::compute_key(const std::string &path_bag, const std::string &topic_imu, const std::string &topic_vicon, double bag_start,
+                                double bag_durr) {
+
+  // FNV-1a hash of the raw bytes of each field
+  uint64_t hash = 14695981039346656037ULL;
+  auto append = [&](const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+    }
+  };
+
+  // We use the size and modification time as a fingerprint of the bag
+  // This avoids reading the whole bag (which is what we are trying to avoid in the first place)
+  uint64_t bag_size = 0;
+  int64_t bag_time = 0;
+  boost::system::error_code ec;
+  boost::filesystem::path p(path_bag);
+  bag_size = (uint64_t)boost::filesystem::file_size(p, ec);
+  bag_time = (int64_t)boost::filesystem::last_write_time(p, ec);
+  std::string path_abs = boost::filesystem::absolute(p).string();
+
+  // Now hash everything
+  uint32_t version = VERSION;
+  append(&version, sizeof(version));
+  append(path_abs.data(), path_abs.size() + 1);
+  append(&bag_size, sizeof(bag_size));
+  append(&bag_time, sizeof(bag_time));
+  append(topic_imu.data(), topic_imu.size() + 1);
+  append(topic_vicon.data(), topic_vicon.size() + 1);
+  append(&bag_start, sizeof(bag_start));
+  append(&bag_durr, sizeof(bag_durr));
+  return hash;
+}
+
+void MeasCache::append(const BAGDATA &data) {
+  if (data.type == BagDataType::IMU) {
+    records_imu.push_back(data.timestamp);
+    records_imu.insert(records_imu.end(), data.wm.data(), data.wm.data() + 3);
+    records_imu.insert(records_imu.end(), data.am.data(), data.am.data() + 3);
+  } else if (data.type != BagDataType::UNKNOWN) {
+    Eigen::Matrix<double, 6, 6> pose_cov = Eigen::Matrix<double, 6, 6>::Zero();
+    if (data.type == BagDataType::VICON_ODOM)
+      pose_cov = data.pose_cov;
+    records_vicon.push_back((double)data.type);
+    records_vicon.push_back(data.timestamp);
+    records_vicon.insert(records_vicon.end(), data.q.data(), data.q.data() + 4);
+    records_vicon.insert(records_vicon.end(), data.p.data(), data.p.data() + 3);
+    records_vicon.insert(records_vicon.end(), pose_cov.data(), pose_cov.data() + 36);
+  }
+}
+
+bool MeasCache::write(double time_init) const {
+
+  // Create our header
+  Header header;
+  std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version = VERSION;
+  header.reserved = 0;
+  header.key = key;
+  header.num_imu = records_imu.size() / SIZE_IMU;
+  header.num_vicon = records_vicon.size() / SIZE_VICON;
+  header.time_init = time_init;
+
+  // Write to a temporary file, and then move it into place
+  // This ensures that we never leave a partially written cache if we crash
+  boost::system::error_code ec;
+  boost::filesystem::path p(path);
+  if (p.has_parent_path())
+    boost::filesystem::create_directories(p.parent_path(), ec);
+  std::string path_tmp = path + ".tmp";
+  std::ofstream file(path_tmp, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if (!file.is_open())
+    return false;
+  file.write((const char *)&header, sizeof(header));
+  file.write((const char *)records_imu.data(), records_imu.size() * sizeof(double));
+  file.write((const char *)records_vicon.data(), records_vicon.size() * sizeof(double));
+  file.close();
+  if (!file) {
+    boost::filesystem::remove(path_tmp, ec);
+    return false;
+  }
+  boost::filesystem::rename(path_tmp, path, ec);
+  return !ec;
+}
+
+bool MeasCache::load(double &time_init, const std::function<void(const BAGDATA &)> &callback) const {
+
+  // Open and map the file
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  // Check that this is the data we want, and that it is complete
+  const Header *header = (const Header *)map;
+  size_t size_expected = sizeof(Header) + (header->num_imu * SIZE_IMU + header->num_vicon * SIZE_VICON) * sizeof(double);
+  if (std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header->version != VERSION || header->key != key ||
+      size != size_expected) {
+    munmap(map, size);
+    return false;
+  }
+  time_init = header->time_init;
+
+  // Finally copy each record out of the mapping and give it to the callback
+  BAGDATA data;
+  const double *records = (const double *)((const char *)map + sizeof(Header));
+  for (size_t i = 0; i < header->num_imu; i++) {
+    const double *record = records + i * SIZE_IMU;
+    data.type = BagDataType::IMU;
+    data.timestamp = record[0];
+    data.wm = Eigen::Map<const Eigen::Vector3d>(record + 1);
+    data.am = Eigen::Map<const Eigen::Vector3d>(record + 4);
+    callback(data);
+  }
+  records += header->num_imu * SIZE_IMU;
+  for (size_t i = 0; i < header->num_vicon; i++) {
+    const double *record = records + i * SIZE_VICON;
+    data.type = (BagDataType)(int)record[0];
+    data.timestamp = record[1];
+    data.q = Eigen::Map<const Eigen::Vector4d>(record + 2);
+    data.p = Eigen::Map<const Eigen::Vector3d>(record + 6);
+    data.pose_cov = Eigen::Map<const Eigen::Matrix<double, 6, 6>>(record + 9);
+    callback(data);
+  }
+  munmap(map, size);
+  return true;
+}
@@ -0,0 +1,114 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef MEASCACHE_H
+#define MEASCACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "meas/BagLoader.h"
+
+/**
+ * @brief Binary cache of the measurements we have extracted from a rosbag.
+ *
+ * This allows for re-running on the same bag without having to parse it again.
+ * The file has a small header followed by a block of IMU records and a block of vicon records, all stored as doubles.
+ * Loading will memory map the file, but each record is still copied into a BAGDATA and given to the callback.
+ * Thus this is not zero-copy, it only saves us from reading and decoding the bag messages.
+ * Vicon records keep the covariance from the bag (if any), so the manual sigmas can still be changed between runs.
+ *
+ * The cache is keyed by the bag path, size, and modification time, along with the topics and time range we loaded.
+ * If any of these change, or the file version is different, the cache is just ignored and re-created.
+ */
+class MeasCache {
+
+public:
+  /**
+   * @brief Default constructor
+   * @param path Path to the cache file
+   * @param key Key of the data this cache should contain (see compute_key())
+   */
+  MeasCache(std::string path, uint64_t key) : path(path), key(key) {}
+
+  /**
+   * @brief Computes the key of the data we will extract from a bag
+   * @param path_bag Path to the rosbag
+   * @param topic_imu Topic of our IMU messages
+   * @param topic_vicon Topic of our vicon messages
+   * @param bag_start Seconds into the bag we start at
+   * @param bag_durr Duration of the bag we load
+   * @return Hash of all these
+   */
+  static uint64_t compute_key(const std::string &path_bag, const std::string &topic_imu, const std::string &topic_vicon, double bag_start,
+                              double bag_durr);
+
+  /// Appends a measurement which will be written to the cache
+  void append(const BAGDATA &data);
+
+  /**
+   * @brief Writes all appended measurements to file
+   * @param time_init Time we started loading the bag at
+   * @return True if we were able to write the file
+   */
+  bool write(double time_init) const;
+
+  /**
+   * @brief Loads the cache from file, if it exists and is valid
+   *
+   * The callback is called on all IMU measurements then all vicon measurements, each in the order they were appended.
+   *
+   * @param time_init Time we started loading the bag at
+   * @param callback Function which will be called on each measurement
+   * @return False if the cache does not exist or is invalid
+   */
+  bool load(double &time_init, const std::function<void(const BAGDATA &)> &callback) const;
+
+private:
+  /// Header at the start of the file
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t num_imu;
+    uint64_t num_vicon;
+    double time_init;
+  };
+
+  /// Current version of the file, change this if the layout changes
+  static const uint32_t VERSION = 1;
+
+  /// Number of doubles in each IMU record (time, wm, am)
+  static const size_t SIZE_IMU = 7;
+
+  /// Number of doubles in each vicon record (type, time, q, p, cov)
+  static const size_t SIZE_VICON = 45;
+
+  // Path and key of this cache
+  std::string path;
+  uint64_t key;
+
+  // Records we have appended
+  std::vector<double> records_imu;
+  std::vector<double> records_vicon;
+};
+
+#endif /* MEASCACHE_H */
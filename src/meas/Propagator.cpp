@@ -18,6 +18,8 @@
  */
 #include "Propagator.h"
 
+#include "utils/parallel.h"
+
 void Propagator::feed_imu(double timestamp, Eigen::Vector3d wm, Eigen::Vector3d am) {
 
   // Create our imu data object
@@ -27,23 +29,82 @@ void Propagator::feed_imu(double timestamp, Eigen::Vector3d wm, Eigen::Vector3d
   data.am = am;
 
   // Append it to our vector
-  imu_data.emplace_back(data);
+  // If it arrived out of order, insert it such that the history stays sorted
+  if (imu_data.empty() || imu_data.back().timestamp <= timestamp) {
+    imu_data.emplace_back(data);
+  } else {
+    auto it = std::upper_bound(imu_data.begin(), imu_data.end(), timestamp,
+                               [](double time, const IMUDATA &imu) { return time < imu.timestamp; });
+    imu_data.insert(it, data);
+  }
 }
 
 bool Propagator::propagate(double time0, double time1, Eigen::Vector3d bg_lin, Eigen::Vector3d ba_lin, CpiV1 &integration) {
 
+  // Ensure we have some measurements in the first place!
+  if (imu_data.empty()) {
+    printf(YELLOW "No IMU measurements to use!!\n" RESET);
+    return false;
+  }
+
+  // Jump to the reading right before our start time
+  // All readings before this one end before time0, thus would be skipped when selecting
+  size_t i_start = lower_bound_index(time0);
+  if (i_start > 0)
+    i_start--;
+
   // First lets construct an IMU vector of measurements we need
   std::vector<IMUDATA> prop_data;
+  if (!select_imu_readings(i_start, time0, time1, prop_data))
+    return false;
 
-  // Ensure we have some measurements in the first place!
+  // Create our IMU measurement between the current state time, and the update time
+  integrate(prop_data, bg_lin, ba_lin, integration);
+  return true;
+}
+
+void Propagator::propagate_batch(const std::vector<double> &times0, const std::vector<double> &times1,
+                                 const std::vector<Eigen::Vector3d> &bg_lin, const std::vector<Eigen::Vector3d> &ba_lin, int num_threads,
+                                 std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> &integrations, std::vector<char> &valid) {
+
+  // Our outputs, one for each interval
+  size_t num_intervals = times0.size();
+  integrations.assign(num_intervals, CpiV1(sigma_w, sigma_wb, sigma_a, sigma_ab, true));
+  valid.assign(num_intervals, 0);
   if (imu_data.empty()) {
     printf(YELLOW "No IMU measurements to use!!\n" RESET);
-    return false;
+    return;
+  }
+
+  // Find the reading right before the start of each interval
+  // Both our start times and readings are sorted, so we can just sweep through them together
+  std::vector<size_t> starts(num_intervals);
+  size_t index = 0;
+  for (size_t i = 0; i < num_intervals; i++) {
+    while (index < imu_data.size() && imu_data.at(index).timestamp < times0.at(i))
+      index++;
+    starts.at(i) = (index > 0) ? index - 1 : 0;
   }
 
+  // Now slice and integrate each interval
+  // Each thread keeps its buffer of readings between intervals
+  parallel_for(num_intervals, num_threads, [&](size_t i) {
+    thread_local std::vector<IMUDATA> prop_data;
+    if (!select_imu_readings(starts.at(i), times0.at(i), times1.at(i), prop_data))
+      return;
+    integrate(prop_data, bg_lin.at(i), ba_lin.at(i), integrations.at(i));
+    valid.at(i) = 1;
+  });
+}
+
+bool Propagator::select_imu_readings(size_t i_start, double time0, double time1, std::vector<IMUDATA> &prop_data) const {
+
+  // Start with no readings
+  prop_data.clear();
+
   // Loop through and find all the needed measurements to propagate with
   // Note we split measurements based on the given state time, and the update timestamp
-  for (size_t i = 0; i < imu_data.size() - 1; i++) {
+  for (size_t i = i_start; i < imu_data.size() - 1; i++) {
 
     // START OF THE INTEGRATION PERIOD
     // If the next timestamp is greater then our current state time
@@ -135,10 +196,11 @@ bool Propagator::propagate(double time0, double time1, Eigen::Vector3d bg_lin, E
   // ROS_INFO("end_prop - start_prop %.3f",prop_data.at(prop_data.size()-1).timestamp-prop_data.at(0).timestamp);
   // ROS_INFO("imu_data_last - state %.3f",imu_data.at(imu_data.size()-1).timestamp-time0);
   // ROS_INFO("update_time - state %.3f",time1-time0);
+  return true;
+}
 
-  //===================================================================================
-  //===================================================================================
-  //===================================================================================
+void Propagator::integrate(const std::vector<IMUDATA> &prop_data, const Eigen::Vector3d &bg_lin, const Eigen::Vector3d &ba_lin,
+                           CpiV1 &integration) const {
 
   // Create our IMU measurement between the current state time, and the update time
   integration = CpiV1(sigma_w, sigma_wb, sigma_a, sigma_ab, true);
@@ -157,9 +219,51 @@ bool Propagator::propagate(double time0, double time1, Eigen::Vector3d bg_lin, E
   // cout << "q_k2tau = " << integration->q_k2tau.transpose() << endl;
   // cout << "alpha_tau = " << integration->alpha_tau.transpose() << endl;
   // cout << "beta_tau = " << integration->beta_tau.transpose() << endl;
+}
 
-  // Finally return this preintegration
-  return true;
+bool Propagator::propagate_dense(double time0, const std::vector<double> &times, const Eigen::Vector3d &bg_lin,
+                                 const Eigen::Vector3d &ba_lin, std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> &integrations) {
+
+  // Ensure we have some measurements and something to do
+  integrations.clear();
+  if (imu_data.empty() || times.empty() || times.front() < time0) {
+    return false;
+  }
+
+  // Get all readings we need to get to the last time
+  size_t i_start = lower_bound_index(time0);
+  if (i_start > 0)
+    i_start--;
+  std::vector<IMUDATA> prop_data;
+  if (!select_imu_readings(i_start, time0, times.back(), prop_data))
+    return false;
+
+  // Integrate each reading, and split it at each time we want the preintegration at
+  CpiV1 integration(sigma_w, sigma_wb, sigma_a, sigma_ab, true);
+  integration.setLinearizationPoints(bg_lin, ba_lin);
+  integrations.reserve(times.size());
+  size_t j = 0;
+  while (j < times.size() && times.at(j) <= prop_data.at(0).timestamp) {
+    integrations.push_back(integration);
+    j++;
+  }
+  for (size_t i = 0; i < prop_data.size() - 1; i++) {
+    IMUDATA data0 = prop_data.at(i);
+    const IMUDATA &data1 = prop_data.at(i + 1);
+    while (j < times.size() && times.at(j) <= data1.timestamp) {
+      if (times.at(j) > data0.timestamp) {
+        IMUDATA data = interpolate_data(prop_data.at(i), data1, times.at(j));
+        integration.feed_IMU(data0.timestamp, data.timestamp, data0.wm, data0.am, data.wm, data.am);
+        data0 = data;
+      }
+      integrations.push_back(integration);
+      j++;
+    }
+    if (data1.timestamp > data0.timestamp) {
+      integration.feed_IMU(data0.timestamp, data1.timestamp, data0.wm, data0.am, data1.wm, data1.am);
+    }
+  }
+  return integrations.size() == times.size();
 }
 
 bool Propagator::has_bounding_imu(double timestamp) {
@@ -169,25 +273,36 @@ bool Propagator::has_bounding_imu(double timestamp) {
     return false;
   }
 
-  // If we have a lower and upper bounding imu
-  bool has_lower = false;
-  bool has_upper = false;
+  // Since our history is sorted, we have a lower and upper bounding imu if we are inside its time range
+  bool has_lower = (imu_data.front().timestamp <= timestamp);
+  bool has_upper = (imu_data.back().timestamp >= timestamp);
+  return (has_lower && has_upper);
+}
 
-  // Loop through and find bounding IMU
-  for (size_t i = 0; i < imu_data.size(); i++) {
-    // Check if we have a lower bound
-    if (imu_data.at(i).timestamp <= timestamp) {
-      has_lower = true;
-    }
-    // Check if we have an upper bound
-    if (imu_data.at(i).timestamp >= timestamp) {
-      has_upper = true;
-    }
-    // Break early
-    if (has_lower && has_upper)
-      break;
+size_t Propagator::lower_bound_index(double timestamp) {
+
+  // Comparison used by our binary searches
+  auto compare = [](const IMUDATA &imu, double time) { return imu.timestamp < time; };
+
+  // If the query went backwards in time, just binary search everything before our cursor
+  size_t hint = std::min(imu_cursor.load(std::memory_order_relaxed), imu_data.size());
+  if (hint < imu_data.size() && imu_data.at(hint).timestamp >= timestamp) {
+    size_t index = std::lower_bound(imu_data.begin(), imu_data.begin() + hint, timestamp, compare) - imu_data.begin();
+    imu_cursor.store(index, std::memory_order_relaxed);
+    return index;
   }
 
-  // Return if we found
-  return (has_lower && has_upper);
+  // Else gallop forward from the cursor till we have passed the timestamp
+  // Then binary search in the last interval we stepped over
+  size_t low = hint;
+  size_t step = 1;
+  size_t high = std::min(low + step, imu_data.size());
+  while (high < imu_data.size() && imu_data.at(high).timestamp < timestamp) {
+    low = high;
+    step *= 2;
+    high = std::min(low + step, imu_data.size());
+  }
+  size_t index = std::lower_bound(imu_data.begin() + low, imu_data.begin() + high, timestamp, compare) - imu_data.begin();
+  imu_cursor.store(index, std::memory_order_relaxed);
+  return index;
 }
@@ -20,6 +20,8 @@
 #define PROPAGATOR_H
 
 #include <Eigen/Eigen>
+#include <algorithm>
+#include <atomic>
 #include <ros/ros.h>
 #include <vector>
 
@@ -45,22 +47,89 @@ public:
     this->sigma_ab = sigmaab;
   }
 
-  /// Our feed function for IMU measurements, will append to our historical vector
+  /// Our feed function for IMU measurements, will append to our historical vector (kept sorted by timestamp)
   void feed_imu(double timestamp, Eigen::Vector3d wm, Eigen::Vector3d am);
 
   /// This will propgate the preintegration class between the two requested timesteps
+  /// This is safe to call from multiple threads at once, as long as no new IMU readings are being fed
   bool propagate(double time0, double time1, Eigen::Vector3d bg_lin, Eigen::Vector3d ba_lin, CpiV1 &integration);
 
+  /**
+   * @brief Preintegrates a batch of intervals.
+   *
+   * Since the intervals are sorted, we first find where each interval starts in the IMU history with a single sweep.
+   * Then each interval is independent, and they are sliced and integrated in parallel.
+   * Each worker reuses its own buffer of sliced readings, so we do not allocate per interval.
+   * The result of each interval is the same as calling propagate() on it.
+   *
+   * @param times0 Start time of each interval (must be sorted)
+   * @param times1 End time of each interval
+   * @param bg_lin Gyroscope bias linearization point of each interval
+   * @param ba_lin Accelerometer bias linearization point of each interval
+   * @param num_threads Number of threads to use (zero or negative will use all hardware threads)
+   * @param integrations Preintegration of each interval
+   * @param valid If each interval was able to be preintegrated
+   */
+  void propagate_batch(const std::vector<double> &times0, const std::vector<double> &times1, const std::vector<Eigen::Vector3d> &bg_lin,
+                       const std::vector<Eigen::Vector3d> &ba_lin, int num_threads,
+                       std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> &integrations, std::vector<char> &valid);
+
+  /**
+   * @brief Integrates forward from a start time, and records the preintegration at each of the requested times.
+   *
+   * This is a single pass over the readings, where we split the reading at each requested time (same as we do at the interval ends).
+   * The preintegration at a requested time is thus the same as propagating to it, up to how the readings were split.
+   * This is safe to call from multiple threads at once, as long as no new IMU readings are being fed.
+   *
+   * @param time0 Start time we integrate from
+   * @param times Times we want the preintegration at (must be sorted and within time0 and the last reading)
+   * @param bg_lin Gyroscope bias we integrate with
+   * @param ba_lin Accelerometer bias we integrate with
+   * @param integrations Preintegration from time0 to each of the times
+   * @return False if we do not have IMU readings for the whole period
+   */
+  bool propagate_dense(double time0, const std::vector<double> &times, const Eigen::Vector3d &bg_lin, const Eigen::Vector3d &ba_lin,
+                       std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> &integrations);
+
+  /// All IMU readings we have, sorted by time
+  const std::vector<IMUDATA> &get_imu_data() const { return imu_data; }
+
   /// Checks if we have bounding IMU poses around a given timestamp
   bool has_bounding_imu(double timestamp);
 
 private:
+  /**
+   * @brief Finds the first IMU reading whose timestamp is not less than the requested time.
+   *
+   * The solver queries the propagator in increasing time order, so we keep a cursor to the last result and gallop forward from it.
+   * This makes each query cost the log of the distance moved, instead of a scan of the whole history.
+   * Queries which go backwards in time fall back to a full binary search.
+   *
+   * @param timestamp Time we want to find the lower bound of
+   * @return Index into our imu_data vector (equal to its size if all readings are before the timestamp)
+   */
+  size_t lower_bound_index(double timestamp);
+
+  /**
+   * @brief Gets the IMU readings needed to integrate between two times, splitting the readings at the ends.
+   * @param i_start Index of the reading right before time0 (or zero)
+   * @param time0 Start of the interval
+   * @param time1 End of the interval
+   * @param prop_data Readings to integrate with (will be cleared first)
+   * @return True if we have at least two readings to integrate
+   */
+  bool select_imu_readings(size_t i_start, double time0, double time1, std::vector<IMUDATA> &prop_data) const;
+
+  /// Preintegrates the selected readings about the given bias linearization point
+  void integrate(const std::vector<IMUDATA> &prop_data, const Eigen::Vector3d &bg_lin, const Eigen::Vector3d &ba_lin,
+                 CpiV1 &integration) const;
+
   /**
    * Nice helper function that will linearly interpolate between two imu messages
    * This should be used instead of just "cutting" imu messages that bound the camera times
    * Give better time offset if we use this function....
    */
-  IMUDATA interpolate_data(IMUDATA imu_1, IMUDATA imu_2, double timestamp) {
+  IMUDATA interpolate_data(IMUDATA imu_1, IMUDATA imu_2, double timestamp) const {
     // time-distance lambda
     double lambda = (timestamp - imu_1.timestamp) / (imu_2.timestamp - imu_1.timestamp);
     // cout << "lambda - " << lambda << endl;
@@ -73,8 +142,13 @@ private:
   }
 
   // Our history of IMU messages (time, angular, linear)
+  // Note that this is sorted by timestamps so we can binary search through it....
   std::vector<IMUDATA> imu_data;
 
+  // Index of the last lower bound we found (hint for monotone queries)
+  // This is only ever a hint which gets verified, thus parallel propagations can share it
+  std::atomic<size_t> imu_cursor{0};
+
   // Our noises
   double sigma_w;  // gyro white noise
   double sigma_wb; // gyro bias walk
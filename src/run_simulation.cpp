@@ -31,6 +31,7 @@
 #include "meas/Interpolator.h"
 #include "meas/Propagator.h"
 #include "sim/Simulator.h"
+#include "solver/StateGridPlanner.h"
 #include "solver/ViconGraphSolver.h"
 #include "utils/stats.h"
 
@@ -52,11 +53,27 @@ int main(int argc, char **argv) {
   nh.param<std::string>("stats_path_info", path_info, "vicon2gt_info.txt");
   nh.param<bool>("save_to_file", save_to_file, false);
   nh.param<int>("state_freq", state_freq, 100);
+
+  // If our states are on a uniform grid, or placed adaptively to the motion (state_freq is then the fastest rate)
+  std::string state_placement;
+  PlacementParams placement;
+  nh.param<std::string>("state_placement", state_placement, "uniform");
+  nh.param<double>("state_freq_min", placement.freq_min, placement.freq_min);
+  nh.param<double>("state_thresh_rot", placement.thresh_rot, placement.thresh_rot);
+  nh.param<double>("state_thresh_accel", placement.thresh_accel, placement.thresh_accel);
+  nh.param<double>("state_thresh_vicon_gap", placement.thresh_vicon_gap, placement.thresh_vicon_gap);
+  nh.param<double>("toff_imu_to_vicon", placement.toff_imu_to_vicon, placement.toff_imu_to_vicon);
+  if (state_placement != "uniform" && state_placement != "adaptive") {
+    ROS_ERROR("state_placement should be uniform or adaptive (got %s)", state_placement.c_str());
+    ROS_ERROR("%s on line %d", __FILE__, __LINE__);
+    std::exit(EXIT_FAILURE);
+  }
   ROS_INFO("save path information...");
   ROS_INFO("    - state path: %s", path_states.c_str());
   ROS_INFO("    - info path: %s", path_info.c_str());
   ROS_INFO("    - save to file: %d", (int)save_to_file);
   ROS_INFO("    - state_freq: %d", state_freq);
+  ROS_INFO("    - state_placement: %s", state_placement.c_str());
 
   //===================================================================================
   //===================================================================================
@@ -146,9 +163,16 @@ int main(int argc, char **argv) {
   }
 
   // Create our camera timestamps at the requested fix frequency
+  // Or place them adaptively to the motion, with the requested frequency being the fastest
   int ct_cam = 0;
   std::vector<double> timestamp_cameras;
-  if (start_time != -1 && end_time != -1 && start_time < end_time) {
+  if (start_time != -1 && end_time != -1 && start_time < end_time && state_placement == "adaptive") {
+    placement.freq_max = (double)state_freq;
+    interpolator->seal();
+    timestamp_cameras = StateGridPlanner(propagator).place_adaptive(start_time, end_time, placement, *interpolator);
+    ct_cam = (int)timestamp_cameras.size();
+    ROS_INFO("placed %d adaptive states (%.1f hz average)", ct_cam, ct_cam / (end_time - start_time));
+  } else if (start_time != -1 && end_time != -1 && start_time < end_time) {
     double temp_time = start_time;
     while (temp_time < end_time) {
       timestamp_cameras.push_back(temp_time);
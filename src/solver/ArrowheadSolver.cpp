@@ -0,0 +1,240 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ArrowheadSolver.h"
+
+#include <gtsam/linear/GaussianFactorGraph.h>
+#include <gtsam/linear/JacobianFactor.h>
+#include <gtsam/linear/VectorValues.h>
+
+ArrowheadSolver::ArrowheadSolver(const std::vector<gtsam::Key> &chain_keys, const std::vector<size_t> &chain_dims,
+                                 const std::vector<gtsam::Key> &global_keys, const std::vector<size_t> &global_dims)
+    : chain_keys(chain_keys), global_keys(global_keys), chain_dims(chain_dims), global_dims(global_dims) {
+  for (size_t i = 0; i < chain_keys.size(); i++) {
+    key_to_block.insert({chain_keys.at(i), (long)i});
+  }
+  for (size_t i = 0; i < global_keys.size(); i++) {
+    key_to_block.insert({global_keys.at(i), -(1 + (long)i)});
+    global_offsets.push_back(global_dim);
+    global_dim += global_dims.at(i);
+  }
+  clear();
+}
+
+void ArrowheadSolver::clear() {
+  size_t num_chain = chain_keys.size();
+  D.resize(num_chain);
+  B.resize((num_chain > 0) ? num_chain - 1 : 0);
+  E.resize(num_chain);
+  b_chain.resize(num_chain);
+  for (size_t i = 0; i < num_chain; i++) {
+    D.at(i).setZero(chain_dims.at(i), chain_dims.at(i));
+    E.at(i).setZero(chain_dims.at(i), global_dim);
+    b_chain.at(i).setZero(chain_dims.at(i));
+    if (i + 1 < num_chain)
+      B.at(i).setZero(chain_dims.at(i), chain_dims.at(i + 1));
+  }
+  G.setZero(global_dim, global_dim);
+  b_global.setZero(global_dim);
+}
+
+bool ArrowheadSolver::add_factor(const std::vector<gtsam::Key> &keys, const Eigen::MatrixXd &A, const Eigen::VectorXd &b) {
+
+  // Find where each variable is, and its columns in the Jacobian
+  // We can handle at most two states, and they need to be neighbors
+  std::vector<long> blocks;
+  std::vector<size_t> cols, dims;
+  long chain_min = -1, chain_max = -1;
+  size_t col = 0;
+  for (const gtsam::Key &key : keys) {
+    auto it = key_to_block.find(key);
+    if (it == key_to_block.end())
+      return false;
+    long block = it->second;
+    size_t dim = (block >= 0) ? chain_dims.at(block) : global_dims.at(-block - 1);
+    if (block >= 0) {
+      chain_min = (chain_min < 0) ? block : std::min(chain_min, block);
+      chain_max = std::max(chain_max, block);
+    }
+    blocks.push_back(block);
+    cols.push_back(col);
+    dims.push_back(dim);
+    col += dim;
+  }
+  if (col != (size_t)A.cols() || A.rows() != b.rows() || chain_max - chain_min > 1)
+    return false;
+
+  // Accumulate A^T*A and A^T*b into our blocks
+  // States are stored in the upper triangle (B_i is between i and i+1), while the globals are stored fully
+  for (size_t k1 = 0; k1 < blocks.size(); k1++) {
+    const auto A1 = A.middleCols(cols.at(k1), dims.at(k1));
+    long b1 = blocks.at(k1);
+    if (b1 >= 0) {
+      b_chain.at(b1).noalias() += A1.transpose() * b;
+    } else {
+      b_global.segment(global_offsets.at(-b1 - 1), dims.at(k1)).noalias() += A1.transpose() * b;
+    }
+    for (size_t k2 = 0; k2 < blocks.size(); k2++) {
+      const auto A2 = A.middleCols(cols.at(k2), dims.at(k2));
+      long b2 = blocks.at(k2);
+      if (b1 >= 0 && b2 >= 0) {
+        if (b1 == b2)
+          D.at(b1).noalias() += A1.transpose() * A2;
+        else if (b1 + 1 == b2)
+          B.at(b1).noalias() += A1.transpose() * A2;
+      } else if (b1 >= 0 && b2 < 0) {
+        E.at(b1).middleCols(global_offsets.at(-b2 - 1), dims.at(k2)).noalias() += A1.transpose() * A2;
+      } else if (b1 < 0 && b2 < 0) {
+        G.block(global_offsets.at(-b1 - 1), global_offsets.at(-b2 - 1), dims.at(k1), dims.at(k2)).noalias() += A1.transpose() * A2;
+      }
+    }
+  }
+  return true;
+}
+
+bool ArrowheadSolver::add_graph(const gtsam::GaussianFactorGraph &graph) {
+  for (const auto &factor : graph) {
+    if (!factor)
+      continue;
+    auto jacobian = boost::dynamic_pointer_cast<gtsam::JacobianFactor>(factor);
+    if (!jacobian || jacobian->isConstrained())
+      return false;
+    std::pair<gtsam::Matrix, gtsam::Vector> Ab = jacobian->jacobian();
+    std::vector<gtsam::Key> keys(jacobian->keys().begin(), jacobian->keys().end());
+    if (!add_factor(keys, Ab.first, Ab.second))
+      return false;
+  }
+  return true;
+}
+
+bool ArrowheadSolver::factorize(double lambda, Factorization &fact) const {
+
+  // Forward sweep, eliminate each state into the next state and the globals
+  // After eliminating state i, its neighbor and the globals get the Schur complement of it
+  size_t num_chain = chain_keys.size();
+  fact.D_llt.resize(num_chain);
+  fact.E_tilde.resize(num_chain);
+  fact.b_tilde.resize(num_chain);
+  Eigen::MatrixXd G_tilde = G + lambda * Eigen::MatrixXd::Identity(global_dim, global_dim);
+  fact.bg_tilde = b_global;
+  Eigen::MatrixXd D_next, E_next;
+  Eigen::VectorXd b_next;
+  for (size_t i = 0; i < num_chain; i++) {
+    // Our current block, which has the contribution of the last state eliminated
+    Eigen::MatrixXd D_i = (i == 0) ? D.at(i) : D_next;
+    D_i.diagonal().array() += lambda;
+    fact.E_tilde.at(i) = (i == 0) ? E.at(i) : E_next;
+    fact.b_tilde.at(i) = (i == 0) ? b_chain.at(i) : b_next;
+    fact.D_llt.at(i).compute(D_i);
+    if (fact.D_llt.at(i).info() != Eigen::Success)
+      return false;
+    // Schur complement onto the globals
+    Eigen::MatrixXd Dinv_E = fact.D_llt.at(i).solve(fact.E_tilde.at(i));
+    Eigen::VectorXd Dinv_b = fact.D_llt.at(i).solve(fact.b_tilde.at(i));
+    G_tilde.noalias() -= fact.E_tilde.at(i).transpose() * Dinv_E;
+    fact.bg_tilde.noalias() -= fact.E_tilde.at(i).transpose() * Dinv_b;
+    // Schur complement onto the next state
+    if (i + 1 < num_chain) {
+      Eigen::MatrixXd Dinv_B = fact.D_llt.at(i).solve(B.at(i));
+      D_next = D.at(i + 1);
+      D_next.noalias() -= B.at(i).transpose() * Dinv_B;
+      E_next = E.at(i + 1);
+      E_next.noalias() -= B.at(i).transpose() * Dinv_E;
+      b_next = b_chain.at(i + 1);
+      b_next.noalias() -= B.at(i).transpose() * Dinv_b;
+    }
+  }
+
+  // Global variables with all states marginalized
+  fact.G_llt.compute(G_tilde);
+  return global_dim == 0 || fact.G_llt.info() == Eigen::Success;
+}
+
+bool ArrowheadSolver::solve(double lambda, std::vector<Eigen::VectorXd> &dx_chain, Eigen::VectorXd &dx_global) const {
+
+  // Eliminate all states into the globals
+  Factorization fact;
+  if (!factorize(lambda, fact))
+    return false;
+  size_t num_chain = chain_keys.size();
+  dx_global = (global_dim > 0) ? Eigen::VectorXd(fact.G_llt.solve(fact.bg_tilde)) : Eigen::VectorXd();
+
+  // Backward sweep, recover each state given the next one and the globals
+  dx_chain.resize(num_chain);
+  for (size_t i = num_chain; i-- > 0;) {
+    Eigen::VectorXd rhs = fact.b_tilde.at(i);
+    if (global_dim > 0)
+      rhs.noalias() -= fact.E_tilde.at(i) * dx_global;
+    if (i + 1 < num_chain)
+      rhs.noalias() -= B.at(i) * dx_chain.at(i + 1);
+    dx_chain.at(i) = fact.D_llt.at(i).solve(rhs);
+  }
+  return true;
+}
+
+bool ArrowheadSolver::marginal_covariances(std::vector<Eigen::MatrixXd> &cov_chain, std::vector<Eigen::MatrixXd> &cov_chain_next,
+                                           Eigen::MatrixXd &cov_global) const {
+
+  // Factorize without any damping
+  Factorization fact;
+  if (!factorize(0.0, fact))
+    return false;
+  size_t num_chain = chain_keys.size();
+  cov_global = (global_dim > 0) ? Eigen::MatrixXd(fact.G_llt.solve(Eigen::MatrixXd::Identity(global_dim, global_dim)))
+                                : Eigen::MatrixXd();
+
+  // Takahashi recursion, backwards through the chain
+  // With U_i = D_i^-1*B_i and V_i = D_i^-1*E_i from our elimination, state i only needs the covariance of what it was eliminated into:
+  // P_(i,i+1) = -U_i*P_(i+1,i+1) - V_i*P_(g,i+1)
+  // P_(i,g) = -U_i*P_(i+1,g) - V_i*P_(g,g)
+  // P_(i,i) = D_i^-1 - U_i*P_(i+1,i) - V_i*P_(g,i)
+  cov_chain.resize(num_chain);
+  cov_chain_next.resize((num_chain > 0) ? num_chain - 1 : 0);
+  Eigen::MatrixXd cov_next_global;
+  for (size_t i = num_chain; i-- > 0;) {
+    Eigen::MatrixXd V = fact.D_llt.at(i).solve(fact.E_tilde.at(i));
+    Eigen::MatrixXd cov_i_global = -V * cov_global;
+    cov_chain.at(i) = fact.D_llt.at(i).solve(Eigen::MatrixXd::Identity(chain_dims.at(i), chain_dims.at(i)));
+    if (i + 1 < num_chain) {
+      Eigen::MatrixXd U = fact.D_llt.at(i).solve(B.at(i));
+      cov_chain_next.at(i) = -U * cov_chain.at(i + 1);
+      cov_chain_next.at(i).noalias() -= V * cov_next_global.transpose();
+      cov_i_global.noalias() -= U * cov_next_global;
+      cov_chain.at(i).noalias() -= U * cov_chain_next.at(i).transpose();
+    }
+    cov_chain.at(i).noalias() -= V * cov_i_global.transpose();
+    cov_chain.at(i) = 0.5 * (cov_chain.at(i) + cov_chain.at(i).transpose()).eval();
+    cov_next_global = cov_i_global;
+  }
+  return true;
+}
+
+bool ArrowheadSolver::solve(double lambda, gtsam::VectorValues &delta) const {
+  std::vector<Eigen::VectorXd> dx_chain;
+  Eigen::VectorXd dx_global;
+  if (!solve(lambda, dx_chain, dx_global))
+    return false;
+  delta.clear();
+  for (size_t i = 0; i < chain_keys.size(); i++) {
+    delta.insert(chain_keys.at(i), dx_chain.at(i));
+  }
+  for (size_t i = 0; i < global_keys.size(); i++) {
+    delta.insert(global_keys.at(i), dx_global.segment(global_offsets.at(i), global_dims.at(i)));
+  }
+  return true;
+}
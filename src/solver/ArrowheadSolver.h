@@ -0,0 +1,142 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef ARROWHEADSOLVER_H
+#define ARROWHEADSOLVER_H
+
+#include <Eigen/Eigen>
+#include <unordered_map>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+
+namespace gtsam {
+class GaussianFactorGraph;
+class VectorValues;
+} // namespace gtsam
+
+/**
+ * @brief Solves the normal equations of a chain of states which are all connected to a few global variables.
+ *
+ * Our information matrix is block tridiagonal over the states (each factor touches at most two neighboring states),
+ * with a dense border for the global variables (i.e. calibration), which looks like an arrowhead:
+ * \f{align*}{
+ * \begin{bmatrix} \mathbf{T} & \mathbf{E} \\ \mathbf{E}^\top & \mathbf{G} \end{bmatrix}
+ * \begin{bmatrix} \delta\mathbf{x} \\ \delta\mathbf{g} \end{bmatrix} =
+ * \begin{bmatrix} \mathbf{b}_x \\ \mathbf{b}_g \end{bmatrix}
+ * \f}
+ *
+ * We eliminate the states in time order (a block Thomas sweep), which also forms the Schur complement onto the globals.
+ * After solving the small global system, we back substitute through the chain.
+ * This only ever stores a few blocks per state, thus is linear in both time and memory.
+ */
+class ArrowheadSolver {
+
+public:
+  /**
+   * @brief Default constructor
+   * @param chain_keys Keys of the states in time order
+   * @param chain_dims Dimension of each state
+   * @param global_keys Keys of all other variables
+   * @param global_dims Dimension of each other variable
+   */
+  ArrowheadSolver(const std::vector<gtsam::Key> &chain_keys, const std::vector<size_t> &chain_dims,
+                  const std::vector<gtsam::Key> &global_keys, const std::vector<size_t> &global_dims);
+
+  /// Sets the system back to zero
+  void clear();
+
+  /**
+   * @brief Adds a whitened linear factor |A*dx - b|^2 to the normal equations
+   * @param keys Variables of this factor (the columns of A are in this order)
+   * @param A Whitened Jacobian
+   * @param b Whitened right hand side
+   * @return False if the factor does not fit our shape (unknown key, or states which are not neighbors)
+   */
+  bool add_factor(const std::vector<gtsam::Key> &keys, const Eigen::MatrixXd &A, const Eigen::VectorXd &b);
+
+  /**
+   * @brief Adds all factors of a linearized graph to the normal equations
+   * @param graph Linearized graph, must only contain Jacobian factors
+   * @return False if any factor does not fit our shape
+   */
+  bool add_graph(const gtsam::GaussianFactorGraph &graph);
+
+  /**
+   * @brief Solves the damped normal equations (H + lambda*I)*dx = A^T*b
+   * @param lambda Levenberg-Marquardt damping
+   * @param dx_chain Update of each state
+   * @param dx_global Update of the global variables (stacked in order)
+   * @return False if the system is not positive definite
+   */
+  bool solve(double lambda, std::vector<Eigen::VectorXd> &dx_chain, Eigen::VectorXd &dx_global) const;
+
+  /// Same as the above, but returns the update of each variable by its key
+  bool solve(double lambda, gtsam::VectorValues &delta) const;
+
+  /**
+   * @brief Recovers the marginal covariances of our variables (the inverse of the information matrix)
+   *
+   * Instead of the full inverse we only recover the blocks which are non-zero in our information (selected inversion).
+   * These are found with the Takahashi recursion over the same elimination our solve uses, so this is still linear in the states.
+   *
+   * @param cov_chain Covariance of each state
+   * @param cov_chain_next Cross-covariance of each state with the next one
+   * @param cov_global Covariance of the global variables (stacked in order)
+   * @return False if the system is not positive definite
+   */
+  bool marginal_covariances(std::vector<Eigen::MatrixXd> &cov_chain, std::vector<Eigen::MatrixXd> &cov_chain_next,
+                            Eigen::MatrixXd &cov_global) const;
+
+private:
+  /// Result of eliminating all states with our forward sweep
+  struct Factorization {
+    std::vector<Eigen::LLT<Eigen::MatrixXd>> D_llt;
+    std::vector<Eigen::MatrixXd> E_tilde;
+    std::vector<Eigen::VectorXd> b_tilde;
+    Eigen::LLT<Eigen::MatrixXd> G_llt;
+    Eigen::VectorXd bg_tilde;
+  };
+
+  /**
+   * @brief Eliminates all states in time order into the globals
+   * @param lambda Levenberg-Marquardt damping
+   * @param fact Factors of each state, and the global system with all states marginalized
+   * @return False if the system is not positive definite
+   */
+  bool factorize(double lambda, Factorization &fact) const;
+
+  // Our variables, a state has a index >= 0, while a global has -(1+index)
+  std::vector<gtsam::Key> chain_keys;
+  std::vector<gtsam::Key> global_keys;
+  std::vector<size_t> chain_dims;
+  std::vector<size_t> global_dims;
+  std::vector<size_t> global_offsets;
+  size_t global_dim = 0;
+  std::unordered_map<gtsam::Key, long> key_to_block;
+
+  // Information matrix blocks (D_i diagonal, B_i between state i and i+1, E_i state to globals, G globals)
+  std::vector<Eigen::MatrixXd> D, B, E;
+  Eigen::MatrixXd G;
+
+  // Information vector blocks
+  std::vector<Eigen::VectorXd> b_chain;
+  Eigen::VectorXd b_global;
+};
+
+#endif /* ARROWHEADSOLVER_H */
@@ -0,0 +1,89 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "ConvergenceMonitor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <gtsam/inference/Symbol.h>
+
+#include "gtsam/JPLNavState.h"
+#include "gtsam/JPLQuaternion.h"
+#include "gtsam/RotationXY.h"
+#include "utils/quat_ops.h"
+
+using gtsam::symbol_shorthand::C;
+using gtsam::symbol_shorthand::G;
+using gtsam::symbol_shorthand::T;
+
+/// Angle in degrees between two JPL quaternions
+static double quat_angle_deg(const Eigen::Vector4d &q0, const Eigen::Vector4d &q1) {
+  return 180.0 / M_PI * log_so3(quat_2_Rot(q1) * quat_2_Rot(q0).transpose()).norm();
+}
+
+const ConvergenceEntry &ConvergenceMonitor::update(int iteration, double error, double lambda, bool accepted,
+                                                   const std::vector<gtsam::Key> &state_keys, const gtsam::Values &values_before,
+                                                   const gtsam::Values &values_after) {
+
+  // Our iteration
+  ConvergenceEntry entry;
+  entry.loop = std::max(loop, 0);
+  entry.iteration = iteration;
+  entry.error = error;
+  entry.lambda = lambda;
+  entry.accepted = accepted;
+  entry.step_norm = values_before.localCoordinates(values_after).norm();
+
+  // Largest change of any state
+  for (const gtsam::Key &key : state_keys) {
+    const JPLNavState &state0 = values_before.at<JPLNavState>(key);
+    const JPLNavState &state1 = values_after.at<JPLNavState>(key);
+    entry.state_dpos = std::max(entry.state_dpos, (state1.p() - state0.p()).norm());
+    entry.state_dori = std::max(entry.state_dori, quat_angle_deg(state0.q(), state1.q()));
+  }
+
+  // Change of the calibration (time offset might not be estimated)
+  entry.calib_dori = quat_angle_deg(values_before.at<JPLQuaternion>(C(0)).q(), values_after.at<JPLQuaternion>(C(0)).q());
+  entry.calib_dpos = (values_after.at<gtsam::Vector3>(C(1)) - values_before.at<gtsam::Vector3>(C(1))).norm();
+  entry.grav_dori = 180.0 / M_PI * log_so3(values_after.at<RotationXY>(G(0)).rot() * values_before.at<RotationXY>(G(0)).rot().transpose()).norm();
+  if (values_before.exists(T(0)) && values_after.exists(T(0))) {
+    entry.calib_dtoff = std::abs(values_after.at<gtsam::Vector1>(T(0))(0) - values_before.at<gtsam::Vector1>(T(0))(0));
+  }
+
+  // Converged if nothing moved more than what we care about, with a step that is not just small due to the damping
+  entry.converged = entry.accepted && entry.lambda <= thresh_lambda && entry.state_dpos < thresh_pos && entry.state_dori < thresh_ori && entry.calib_dpos < thresh_pos &&
+                    entry.calib_dori < thresh_ori && entry.grav_dori < thresh_ori && entry.calib_dtoff < thresh_toff;
+  entries.push_back(entry);
+  return entries.back();
+}
+
+bool ConvergenceMonitor::write_csv(const std::string &path) const {
+  FILE *file = std::fopen(path.c_str(), "w");
+  if (file == nullptr)
+    return false;
+  std::fprintf(file, "# loop,iteration,error,lambda,step_norm,state_dpos(m),state_dori(deg),calib_dpos(m),calib_dori(deg),grav_dori(deg),"
+                     "calib_dtoff(s),accepted,converged\n");
+  for (const auto &entry : entries) {
+    std::fprintf(file, "%d,%d,%.9e,%.9e,%.9e,%.9e,%.9e,%.9e,%.9e,%.9e,%.9e,%d,%d\n", entry.loop, entry.iteration, entry.error, entry.lambda,
+                 entry.step_norm, entry.state_dpos, entry.state_dori, entry.calib_dpos, entry.calib_dori, entry.grav_dori, entry.calib_dtoff,
+                 (int)entry.accepted, (int)entry.converged);
+  }
+  return std::fclose(file) == 0;
+}
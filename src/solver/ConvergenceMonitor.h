@@ -0,0 +1,125 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CONVERGENCEMONITOR_H
+#define CONVERGENCEMONITOR_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/Values.h>
+
+/// Change of our estimate over a single optimizer iteration
+struct ConvergenceEntry {
+
+  /// Relinearization loop and iteration within it
+  int loop = 0;
+  int iteration = 0;
+
+  /// Error after the iteration and the damping its step was solved with
+  double error = 0.0;
+  double lambda = 0.0;
+
+  /// If the step was accepted with the error not increasing (otherwise the estimate did not move)
+  bool accepted = false;
+
+  /// Norm of the full update vector
+  double step_norm = 0.0;
+
+  /// Largest position (meters) and orientation (degrees) change of any state
+  double state_dpos = 0.0;
+  double state_dori = 0.0;
+
+  /// Change of the calibration (position meters, orientations degrees, time offset seconds)
+  double calib_dpos = 0.0;
+  double calib_dori = 0.0;
+  double grav_dori = 0.0;
+  double calib_dtoff = 0.0;
+
+  /// If this iteration passed our convergence criteria
+  bool converged = false;
+};
+
+/**
+ * @brief Records how our estimate changes each optimizer iteration, and decides when it has stopped changing.
+ *
+ * The error tolerances of the optimizer do not say anything about the trajectory itself.
+ * Instead we look at the largest change of any state and of the calibration, and say we are converged once
+ * an iteration moves everything less than what matters for a groundtruth (i.e. 0.1 mm and 0.01 degrees).
+ * A small step can also come from a large damping far from the optimum, so the step also needs to have been
+ * accepted at a damping below our threshold (i.e. close to a Gauss-Newton step).
+ * All iterations are recorded (over all relinearization loops) so the trace can be exported.
+ */
+class ConvergenceMonitor {
+
+public:
+  /**
+   * @brief Default constructor
+   * @param thresh_pos Position change we are converged below (meters, zero or negative never converges)
+   * @param thresh_ori Orientation change we are converged below (degrees)
+   * @param thresh_toff Time offset change we are converged below (seconds)
+   * @param thresh_lambda Largest damping a step can have been solved with to say we are converged
+   */
+  ConvergenceMonitor(double thresh_pos, double thresh_ori, double thresh_toff, double thresh_lambda)
+      : thresh_pos(thresh_pos), thresh_ori(thresh_ori), thresh_toff(thresh_toff), thresh_lambda(thresh_lambda) {}
+
+  /// If we should stop early once converged
+  bool enabled() const { return thresh_pos > 0 && thresh_ori > 0 && thresh_toff > 0; }
+
+  /// Starts a new optimization (next relinearization loop)
+  void start_loop() { loop++; }
+
+  /**
+   * @brief Records a single iteration of the optimizer
+   * @param iteration Iteration number in this loop
+   * @param error Graph error after the iteration
+   * @param lambda Damping the step was solved with
+   * @param accepted If the step was accepted with the error not increasing
+   * @param state_keys Keys of all our states
+   * @param values_before Estimate before the iteration
+   * @param values_after Estimate after the iteration
+   * @return The recorded iteration
+   */
+  const ConvergenceEntry &update(int iteration, double error, double lambda, bool accepted, const std::vector<gtsam::Key> &state_keys,
+                                 const gtsam::Values &values_before, const gtsam::Values &values_after);
+
+  /// If the last recorded iteration of the current loop passed our criteria
+  bool converged() const { return enabled() && !entries.empty() && entries.back().loop == std::max(loop, 0) && entries.back().converged; }
+
+  /// All iterations we have recorded
+  const std::vector<ConvergenceEntry> &get_entries() const { return entries; }
+
+  /**
+   * @brief Writes all recorded iterations to a CSV file (one row per iteration)
+   * @param path Path to the file we will write
+   * @return True if we were able to write the file
+   */
+  bool write_csv(const std::string &path) const;
+
+private:
+  // Thresholds we are converged below
+  double thresh_pos, thresh_ori, thresh_toff, thresh_lambda;
+
+  // Current loop, and all iterations
+  int loop = -1;
+  std::vector<ConvergenceEntry> entries;
+};
+
+#endif /* CONVERGENCEMONITOR_H */
@@ -0,0 +1,117 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "StateGridPlanner.h"
+
+#include <algorithm>
+
+std::vector<double> StateGridPlanner::place_adaptive(double time_start, double time_end, const PlacementParams &params,
+                                                     const Interpolator &interpolator) const {
+
+  // Our first state, and the IMU readings right after it
+  std::vector<double> timestamps;
+  if (time_start >= time_end)
+    return timestamps;
+  timestamps.push_back(time_start);
+  const std::vector<IMUDATA> &imu_data = propagator->get_imu_data();
+  auto compare = [](const IMUDATA &imu, double time) { return imu.timestamp <= time; };
+  size_t i_imu = std::lower_bound(imu_data.begin(), imu_data.end(), time_start, compare) - imu_data.begin();
+
+  // Motion since the last state we placed
+  double time_last = time_start;
+  double rotation = 0.0;
+  double accel_change = 0.0;
+  bool has_accel_ref = false;
+  Eigen::Vector3d accel_ref = Eigen::Vector3d::Zero();
+
+  // Our vicon dropout threshold is relative to the nominal vicon rate, so normal spacing of slow vicon is not a dropout
+  const double vicon_period = interpolator.get_median_period();
+  const double vicon_gap = params.thresh_vicon_gap * vicon_period;
+  size_t num_placed_gap = 0;
+
+  // Go through each candidate time, and add the IMU readings up to it
+  const double dt_min = 1.0 / params.freq_max;
+  const double dt_max = 1.0 / params.freq_min;
+  for (size_t k = 1; time_start + k * dt_min < time_end; k++) {
+    double time = time_start + k * dt_min;
+    for (; i_imu < imu_data.size() && imu_data.at(i_imu).timestamp <= time; i_imu++) {
+      const IMUDATA &imu = imu_data.at(i_imu);
+      double dt = (i_imu > 0) ? imu.timestamp - std::max(imu_data.at(i_imu - 1).timestamp, time_last) : 0.0;
+      rotation += imu.wm.norm() * dt;
+      if (!has_accel_ref) {
+        accel_ref = imu.am;
+        has_accel_ref = true;
+      }
+      accel_change = std::max(accel_change, (imu.am - accel_ref).norm());
+    }
+
+    // Place a state if we have moved enough, or have gone too long without one
+    // Our candidate times are in the IMU clock, so we move them into the vicon clock to check for a dropout
+    bool place_motion = (time - time_last >= dt_max - 1e-9) || (rotation >= params.thresh_rot) || (accel_change >= params.thresh_accel);
+    double time_last_inV = time_last - params.toff_imu_to_vicon;
+    double time_inV = time - params.toff_imu_to_vicon;
+    bool place_gap = !place_motion && interpolator.get_max_gap(time_last_inV, time_inV) > vicon_gap;
+    if (place_motion || place_gap) {
+      num_placed_gap += (place_gap) ? 1 : 0;
+      timestamps.push_back(time);
+      time_last = time;
+      rotation = 0.0;
+      accel_change = 0.0;
+      has_accel_ref = false;
+    }
+  }
+  ROS_INFO("placed %zu adaptive states due to vicon gaps over %.4f sec (median vicon period %.4f sec)", num_placed_gap, vicon_gap,
+           vicon_period);
+  return timestamps;
+}
+
+std::string StateGridPlanner::reason_to_string(DropReason reason) {
+  switch (reason) {
+  case DropReason::NONE:
+    return "valid";
+  case DropReason::NO_IMU:
+    return "no imu";
+  case DropReason::BEFORE_VICON:
+    return "before first vicon";
+  case DropReason::AFTER_VICON:
+    return "after last vicon";
+  case DropReason::NO_VICON_POSE:
+    return "no vicon pose found";
+  case DropReason::INVALID_VICON_COV:
+    return "invalid vicon covariance";
+  case DropReason::SHUTDOWN:
+    return "shutdown before checked";
+  }
+  return "unknown";
+}
+
+size_t StateGridPlanner::count(const std::vector<DroppedRange> &dropped, DropReason reason) {
+  size_t total = 0;
+  for (const auto &range : dropped) {
+    if (range.reason == reason)
+      total += range.count;
+  }
+  return total;
+}
+
+void StateGridPlanner::print(const std::vector<DroppedRange> &dropped) {
+  for (const auto &range : dropped) {
+    ROS_INFO("    - dropped %zu states from %.9f to %.9f (%s)", range.count, range.time_start, range.time_end,
+             reason_to_string(range.reason).c_str());
+  }
+}
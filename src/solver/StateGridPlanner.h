@@ -0,0 +1,177 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STATEGRIDPLANNER_H
+#define STATEGRIDPLANNER_H
+
+#include <cassert>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "meas/Interpolator.h"
+#include "meas/Propagator.h"
+
+/// Reason we have removed a state from our grid
+enum class DropReason { NONE, NO_IMU, BEFORE_VICON, AFTER_VICON, NO_VICON_POSE, INVALID_VICON_COV, SHUTDOWN };
+
+/// Consecutive states which have been removed for the same reason
+struct DroppedRange {
+  double time_start;
+  double time_end;
+  size_t count;
+  DropReason reason;
+};
+
+/// Settings for where we will place states when they are adaptive to the motion
+struct PlacementParams {
+  /// Fastest (used during fast motion) and slowest (used when static) rate of states (hz)
+  double freq_max = 100.0;
+  double freq_min = 10.0;
+
+  /// Rotation (rad) and change of acceleration (m/s^2) of the IMU we allow between two states
+  double thresh_rot = 0.05;
+  double thresh_accel = 0.5;
+
+  /// Time between two vicon poses, in multiples of the median vicon period, above which we consider a dropout
+  /// Here we place states at the fastest rate
+  double thresh_vicon_gap = 3.0;
+
+  /// Initial guess of the time offset between the IMU and vicon clocks (t_imu = t_vicon + toff)
+  double toff_imu_to_vicon = 0.0;
+};
+
+/**
+ * @brief Decides which of our state times are valid to estimate.
+ *
+ * States are checked in a single pass over the grid and the valid ones are compacted in place (keeping their order).
+ * Consecutive states that are removed for the same reason get merged into a single range, so we can report what was dropped.
+ */
+class StateGridPlanner {
+
+public:
+  /**
+   * @brief Default constructor
+   * @param propagator Propagator with all IMU measurements inside
+   */
+  StateGridPlanner(std::shared_ptr<Propagator> propagator) : propagator(propagator) {}
+
+  /**
+   * @brief Places states between two times, dense during fast motion and sparse when (nearly) static.
+   *
+   * Candidate times are a grid at the fastest rate, and we sweep through them in order with the IMU readings.
+   * We place a state at a candidate if since the last state we have:
+   * - rotated more than the threshold (integral of the angular rate)
+   * - had the acceleration change more than the threshold (i.e. high jerk)
+   * - a dropout of the vicon, since then only the IMU constrains the states
+   * - reached the time of the slowest rate
+   *
+   * @param time_start First state time
+   * @param time_end States will be before this time
+   * @param params Rates and thresholds of the placement
+   * @param interpolator Interpolator with all vicon poses inside (needs to be sealed)
+   * @return State times which are increasing
+   */
+  std::vector<double> place_adaptive(double time_start, double time_end, const PlacementParams &params,
+                                     const Interpolator &interpolator) const;
+
+  /**
+   * @brief Checks if a state has IMU readings around it and is inside the range of our vicon poses
+   * @param timestamp State time (in the IMU clock)
+   * @param time_vicon_min First time we can use the vicon at (in the IMU clock)
+   * @param time_vicon_max Last time we can use the vicon at (in the IMU clock)
+   * @return Reason this state is invalid, or NONE if it is valid
+   */
+  DropReason check_coverage(double timestamp, double time_vicon_min, double time_vicon_max) const {
+    if (!propagator->has_bounding_imu(timestamp))
+      return DropReason::NO_IMU;
+    if (timestamp < time_vicon_min)
+      return DropReason::BEFORE_VICON;
+    if (timestamp > time_vicon_max)
+      return DropReason::AFTER_VICON;
+    return DropReason::NONE;
+  }
+
+  /**
+   * @brief Removes all invalid state times in a single pass
+   *
+   * The check function is called exactly once on each time, in order, and returns why it is invalid (or NONE to keep it).
+   * Thus it can also be used to do work on the valid states as we go (e.g. initialize them).
+   *
+   * @param timestamps State times, will be compacted in place
+   * @param check Function taking a timestamp and returning a DropReason
+   * @return Ranges of states which were removed
+   */
+  template <typename Func> static std::vector<DroppedRange> compact(std::vector<double> &timestamps, const Func &check) {
+    std::vector<size_t> ids(timestamps.size(), 0);
+    return compact(timestamps, ids, [&](double timestamp, size_t) { return check(timestamp); });
+  }
+
+  /**
+   * @brief Removes all invalid state times in a single pass, along with their IDs
+   *
+   * Same as the above, but the check function is also given the ID of each state, and the IDs are compacted with the times.
+   *
+   * @param timestamps State times, will be compacted in place
+   * @param ids ID of each state, will be compacted in place
+   * @param check Function taking a timestamp and ID, and returning a DropReason
+   * @return Ranges of states which were removed
+   */
+  template <typename Func>
+  static std::vector<DroppedRange> compact(std::vector<double> &timestamps, std::vector<size_t> &ids, const Func &check) {
+    assert(timestamps.size() == ids.size());
+    std::vector<DroppedRange> dropped;
+    size_t num_keep = 0;
+    bool last_dropped = false;
+    for (size_t i = 0; i < timestamps.size(); i++) {
+      double timestamp = timestamps[i];
+      size_t id = ids[i];
+      DropReason reason = check(timestamp, id);
+      if (reason == DropReason::NONE) {
+        timestamps[num_keep] = timestamp;
+        ids[num_keep] = id;
+        num_keep++;
+        last_dropped = false;
+      } else if (last_dropped && dropped.back().reason == reason) {
+        dropped.back().time_end = timestamp;
+        dropped.back().count++;
+      } else {
+        dropped.push_back({timestamp, timestamp, 1, reason});
+        last_dropped = true;
+      }
+    }
+    timestamps.resize(num_keep);
+    ids.resize(num_keep);
+    return dropped;
+  }
+
+  /// Nice name of why we dropped a state
+  static std::string reason_to_string(DropReason reason);
+
+  /// Counts the number of states dropped for a given reason
+  static size_t count(const std::vector<DroppedRange> &dropped, DropReason reason);
+
+  /// Prints each dropped range to console
+  static void print(const std::vector<DroppedRange> &dropped);
+
+private:
+  // Our IMU measurements
+  std::shared_ptr<Propagator> propagator;
+};
+
+#endif /* STATEGRIDPLANNER_H */
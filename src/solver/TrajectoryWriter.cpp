@@ -0,0 +1,232 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "TrajectoryWriter.h"
+
+#include <cmath>
+#include <cstdio>
+
+#include "utils/parallel.h"
+
+/// Exact powers of ten we can scale with
+static double pow10_table(int k) {
+  static const double table[23] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  return table[k];
+}
+
+/// Appends an integer valued double (i.e. our nanosecond timestamps) to the buffer, same as printf("%.0f")
+static void append_integer(std::string &buffer, double value) {
+  if (std::abs(value) >= 9e18) {
+    char field[64];
+    int len = std::snprintf(field, sizeof(field), "%.0f", value);
+    buffer.append(field, len);
+    return;
+  }
+  char digits[24];
+  int64_t integer = (int64_t)value;
+  uint64_t mag = (integer < 0) ? (uint64_t)(-integer) : (uint64_t)integer;
+  int len = 0;
+  do {
+    digits[len++] = (char)('0' + mag % 10);
+    mag /= 10;
+  } while (mag > 0);
+  if (integer < 0 || (integer == 0 && std::signbit(value)))
+    buffer.push_back('-');
+  while (len > 0)
+    buffer.push_back(digits[--len]);
+}
+
+/**
+ * @brief Appends a double with six significant digits to the buffer, same as printf("%.6g")
+ *
+ * We scale the value so its six digits are the integer part, and round that.
+ * The scaling has at most one rounding error, so if the fraction is close to one half we can not be sure which way printf would round.
+ * In that case (and for values too large or small to scale exactly) we just use printf.
+ */
+static void append_g6(std::string &buffer, double value) {
+  double mag = std::abs(value);
+  int exp10 = (mag > 0 && std::isfinite(mag)) ? (int)std::floor(std::log10(mag)) : 0;
+  if (mag == 0.0 || !std::isfinite(mag) || exp10 < -16 || exp10 > 26) {
+    char field[64];
+    int len = std::snprintf(field, sizeof(field), "%.6g", value);
+    buffer.append(field, len);
+    return;
+  }
+
+  // Scale so we have six digits in front of the decimal (10^k is exact for |k| <= 22)
+  // Our log10 can be off by one right at a power of ten, so correct it using the scaled value
+  // Every scaled value we decide with needs to be far enough from a rounding tie
+  double scaled = 0.0;
+  bool near_tie = false;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int k = 5 - exp10;
+    scaled = (k >= 0) ? mag * pow10_table(k) : mag / pow10_table(-k);
+    near_tie = near_tie || std::abs(scaled - std::floor(scaled) - 0.5) < 1e-6;
+    if (scaled >= 999999.5) {
+      exp10++;
+    } else if (scaled < 99999.5) {
+      exp10--;
+    } else {
+      break;
+    }
+  }
+  if (near_tie || scaled < 99999.5 || scaled >= 999999.5) {
+    char field[64];
+    int len = std::snprintf(field, sizeof(field), "%.6g", value);
+    buffer.append(field, len);
+    return;
+  }
+
+  // Our six digits
+  int64_t mantissa = (int64_t)std::floor(scaled + 0.5);
+  char digits[6];
+  for (int i = 5; i >= 0; i--) {
+    digits[i] = (char)('0' + mantissa % 10);
+    mantissa /= 10;
+  }
+  int num_digits = 6;
+  if (std::signbit(value))
+    buffer.push_back('-');
+
+  // Fixed notation, trailing zeros after the decimal are removed
+  if (exp10 >= -4 && exp10 < 6) {
+    int num_int = exp10 + 1;
+    while (num_digits > std::max(num_int, 0) && digits[num_digits - 1] == '0')
+      num_digits--;
+    if (num_int <= 0) {
+      buffer.append("0.");
+      buffer.append((size_t)(-num_int), '0');
+      buffer.append(digits, num_digits);
+    } else {
+      buffer.append(digits, num_int);
+      if (num_digits > num_int) {
+        buffer.push_back('.');
+        buffer.append(digits + num_int, num_digits - num_int);
+      }
+    }
+    return;
+  }
+
+  // Scientific notation, with at least two exponent digits
+  while (num_digits > 1 && digits[num_digits - 1] == '0')
+    num_digits--;
+  buffer.push_back(digits[0]);
+  if (num_digits > 1) {
+    buffer.push_back('.');
+    buffer.append(digits + 1, num_digits - 1);
+  }
+  buffer.push_back('e');
+  buffer.push_back((exp10 < 0) ? '-' : '+');
+  int exp_mag = std::abs(exp10);
+  if (exp_mag < 10)
+    buffer.push_back('0');
+  append_integer(buffer, (double)exp_mag);
+}
+
+void TrajectoryWriter::start(const std::string &csvfilepath, const std::string &binfilepath, std::vector<double> times,
+                             std::vector<Row> rows, const TrajectoryCalibration &calib) {
+  wait();
+  this->times = std::move(times);
+  this->rows = std::move(rows);
+  this->calib = calib;
+  thread = std::thread([this, csvfilepath, binfilepath]() {
+    bool ok = true;
+    if (!csvfilepath.empty())
+      ok = write_csv(csvfilepath) && ok;
+    if (!binfilepath.empty())
+      ok = write_binary(binfilepath) && ok;
+    success = ok;
+  });
+}
+
+bool TrajectoryWriter::wait() {
+  if (thread.joinable())
+    thread.join();
+  return success;
+}
+
+bool TrajectoryWriter::write_csv(const std::string &path) const {
+
+  // Format each chunk of rows into its own buffer
+  // Time is an integer number of nanoseconds, all else has six significant digits (same as the default stream precision)
+  const size_t chunk_size = 8192;
+  size_t num_chunks = (times.size() + chunk_size - 1) / chunk_size;
+  std::vector<std::string> buffers(num_chunks);
+  parallel_for(num_chunks, num_threads, [&](size_t c) {
+    size_t end = std::min((c + 1) * chunk_size, times.size());
+    std::string &buffer = buffers.at(c);
+    buffer.reserve((end - c * chunk_size) * 200);
+    for (size_t i = c * chunk_size; i < end; i++) {
+      append_integer(buffer, std::floor(1e9 * times.at(i)));
+      for (const double &value : rows.at(i)) {
+        buffer.push_back(',');
+        append_g6(buffer, value);
+      }
+      buffer.push_back('\n');
+    }
+  });
+
+  // Write them all in order
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    return false;
+  const std::string header = "#time(ns),px,py,pz,qw,qx,qy,qz,vx,vy,vz,bwx,bwy,bwz,bax,bay,baz\n";
+  bool ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+  for (const auto &buffer : buffers) {
+    ok = ok && std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+  }
+  return (std::fclose(file) == 0) && ok;
+}
+
+bool TrajectoryWriter::write_binary(const std::string &path) const {
+
+  // Our header with the calibration
+  TrajectoryBinaryHeader header;
+  header.num_rows = times.size();
+  for (int i = 0; i < 4; i++)
+    header.q_BtoI[i] = calib.q_BtoI(i);
+  for (int i = 0; i < 3; i++)
+    header.p_BinI[i] = calib.p_BinI(i);
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++) {
+      header.R_GtoV[3 * r + c] = calib.R_GtoV(r, c);
+    }
+  }
+  header.gravity_magnitude = calib.gravity_magnitude;
+  header.toff_vicon_to_imu = calib.toff_vicon_to_imu;
+
+  // Transpose into columns, time first as integer nanoseconds
+  std::vector<int64_t> col_time(times.size());
+  std::vector<double> col_values(times.size() * 16);
+  for (size_t i = 0; i < times.size(); i++) {
+    col_time.at(i) = (int64_t)std::floor(1e9 * times.at(i));
+    for (size_t j = 0; j < 16; j++) {
+      col_values.at(j * times.size() + i) = rows.at(i).at(j);
+    }
+  }
+
+  // Write it
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    return false;
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && std::fwrite(col_time.data(), sizeof(int64_t), col_time.size(), file) == col_time.size();
+  ok = ok && std::fwrite(col_values.data(), sizeof(double), col_values.size(), file) == col_values.size();
+  return (std::fclose(file) == 0) && ok;
+}
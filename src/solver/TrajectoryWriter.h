@@ -0,0 +1,116 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TRAJECTORYWRITER_H
+#define TRAJECTORYWRITER_H
+
+#include <Eigen/Eigen>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Calibration we save in the header of the binary trajectory (same as the info file)
+struct TrajectoryCalibration {
+  Eigen::Vector4d q_BtoI = Eigen::Vector4d(0, 0, 0, 1);
+  Eigen::Vector3d p_BinI = Eigen::Vector3d::Zero();
+  Eigen::Matrix3d R_GtoV = Eigen::Matrix3d::Identity();
+  double gravity_magnitude = 9.81;
+  double toff_vicon_to_imu = 0.0;
+};
+
+/// Header of the binary trajectory file, all columns follow it (each is num_rows long)
+/// The header is 256 bytes so every column is 8 byte aligned and the file can be memory mapped as is
+struct TrajectoryBinaryHeader {
+  char magic[8] = {'V', '2', 'G', 'T', 'T', 'R', 'A', 'J'};
+  uint32_t version = 1;
+  uint32_t num_cols = 17;
+  uint64_t num_rows = 0;
+  double q_BtoI[4] = {0, 0, 0, 1};
+  double p_BinI[3] = {0, 0, 0};
+  double R_GtoV[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+  double gravity_magnitude = 9.81;
+  double toff_vicon_to_imu = 0.0;
+  uint8_t padding[256 - 24 - 18 * 8] = {0};
+};
+static_assert(sizeof(TrajectoryBinaryHeader) == 256, "binary trajectory header should be 256 bytes");
+
+/**
+ * @brief Writes our optimized trajectory to file on a background thread.
+ *
+ * The CSV file is in the eth format `(time(ns),px,py,pz,qw,qx,qy,qz,vx,vy,vz,bwx,bwy,bwz,bax,bay,baz)`.
+ * Rows are formatted in parallel chunks into large buffers, and then written in order with a single write each.
+ * The time is printed as an integer and all other fields with six significant digits, same as a stream would.
+ *
+ * The optional binary file is columnar: the header (see TrajectoryBinaryHeader) and then each column in the same order as the CSV.
+ * The time column is int64 nanoseconds and all others are doubles.
+ */
+class TrajectoryWriter {
+
+public:
+  /// A single row of the trajectory (p, q(wxyz), v, bw, ba)
+  typedef std::array<double, 16> Row;
+
+  /**
+   * @brief Default constructor
+   * @param num_threads Number of threads we will format the text with
+   */
+  TrajectoryWriter(int num_threads) : num_threads(num_threads) {}
+
+  /// Will wait for any writing to finish
+  ~TrajectoryWriter() { wait(); }
+
+  /**
+   * @brief Starts writing the trajectory in the background (waits for any previous write first)
+   * @param csvfilepath CSV file we will write (empty will not write it)
+   * @param binfilepath Binary file we will write (empty will not write it)
+   * @param times Timestamp of each row in seconds
+   * @param rows Values of each row
+   * @param calib Calibration we will save in the binary header
+   */
+  void start(const std::string &csvfilepath, const std::string &binfilepath, std::vector<double> times, std::vector<Row> rows,
+             const TrajectoryCalibration &calib);
+
+  /**
+   * @brief Waits for the current write to finish
+   * @return True if all files were written
+   */
+  bool wait();
+
+private:
+  /// Formats and writes the CSV file
+  bool write_csv(const std::string &path) const;
+
+  /// Writes the binary columnar file
+  bool write_binary(const std::string &path) const;
+
+  // Number of threads we format with
+  int num_threads;
+
+  // Data we are writing
+  std::vector<double> times;
+  std::vector<Row> rows;
+  TrajectoryCalibration calib;
+
+  // Background thread and if it succeeded
+  std::thread thread;
+  bool success = true;
+};
+
+#endif /* TRAJECTORYWRITER_H */
@@ -19,13 +19,18 @@
 #include "ViconGraphSolver.h"
 
 ViconGraphSolver::ViconGraphSolver(ros::NodeHandle &nh, std::shared_ptr<Propagator> propagator, std::shared_ptr<Interpolator> interpolator,
-                                   std::vector<double> timestamp_cameras) {
+                                   std::vector<double> timestamp_cameras, std::shared_ptr<Profiler> profiler) {
 
   // save measurement data
   this->nh = nh;
   this->propagator = propagator;
   this->interpolator = interpolator;
   this->timestamp_cameras = timestamp_cameras;
+  this->profiler = (profiler != nullptr) ? profiler : std::make_shared<Profiler>();
+  this->planner = std::make_shared<StateGridPlanner>(propagator);
+
+  // Sort our vicon poses so they can be queried
+  this->interpolator->seal();
 
   // Initalize our graphs
   this->graph = new gtsam::NonlinearFactorGraph();
@@ -71,14 +76,96 @@ ViconGraphSolver::ViconGraphSolver(ros::NodeHandle &nh, std::shared_ptr<Propagat
   nh.param<bool>("estimate_ori_vicon_to_imu", config->estimate_vicon_imu_ori, config->estimate_vicon_imu_ori);
   nh.param<bool>("estimate_pos_vicon_to_imu", config->estimate_vicon_imu_pos, config->estimate_vicon_imu_pos);
 
+  // Resolution the vicon factors will re-use their interpolated measurement at
+  nh.param<double>("vicon_cache_resolution", config->vicon_cache_resolution, config->vicon_cache_resolution);
+
   // Number of times we relinearize
   nh.param<int>("num_loop_relin", num_loop_relin, 0);
 
+  // How far the bias can move from where we preintegrated before we need to integrate again when relinearizing
+  // Below this the IMU factor will correct the preintegration to first order (negative will always integrate again)
+  nh.param<double>("relin_bias_thresh_gyro", relin_bias_thresh_gyro, 1e-3);
+  nh.param<double>("relin_bias_thresh_accel", relin_bias_thresh_accel, 1e-2);
+
+  // Number of threads we can use (zero or negative will use all hardware threads)
+  nh.param<int>("num_threads", num_threads, -1);
+  num_threads = get_num_threads(num_threads);
+
+  // Elimination ordering of our batch optimization (chain or metis)
+  nh.param<std::string>("ordering_type", ordering_type, "metis");
+  if (ordering_type != "chain" && ordering_type != "metis") {
+    ROS_ERROR("[VICON-GRAPH]: ordering_type should be chain or metis (got %s)", ordering_type.c_str());
+    ROS_ERROR("%s on line %d", __FILE__, __LINE__);
+    std::exit(EXIT_FAILURE);
+  }
+
+  // When the batch optimization has converged, an iteration moves no state or calibration more than these (meters, degrees, seconds)
+  // The step also needs to have been accepted at a damping below the lambda threshold, so it is not just small due to the damping
+  // Zero or negative will always run all iterations
+  double converge_pos_thresh, converge_ori_thresh, converge_toff_thresh, converge_lambda_thresh;
+  nh.param<double>("converge_pos_thresh", converge_pos_thresh, 1e-4);
+  nh.param<double>("converge_ori_thresh", converge_ori_thresh, 0.01);
+  nh.param<double>("converge_toff_thresh", converge_toff_thresh, 1e-5);
+  nh.param<double>("converge_lambda_thresh", converge_lambda_thresh, 1e-3);
+  monitor = std::make_shared<ConvergenceMonitor>(converge_pos_thresh, converge_ori_thresh, converge_toff_thresh, converge_lambda_thresh);
+
+  // Rate we will output the trajectory at by integrating the IMU between our states (zero or negative will just output our states)
+  nh.param<double>("output_freq", output_freq, -1.0);
+
+  // If we should also save the states in a binary columnar file next to the csv
+  nh.param<bool>("save_binary", save_binary, false);
+
+  // If we should export the marginal covariance of each state and the calibration
+  nh.param<bool>("export_covariance", export_covariance, false);
+
+  // If we should solve each batch step with our own block-tridiagonal solver (falls back to gtsam if the graph does not fit)
+  nh.param<bool>("use_arrowhead_solver", use_arrowhead_solver, false);
+
+  // If we should incrementally solve in chunks of time instead of a single batch
+  nh.param<bool>("use_isam2", use_isam2, false);
+  nh.param<double>("isam2_chunk_sec", isam2_chunk_sec, 30.0);
+  nh.param<double>("isam2_lag_sec", isam2_lag_sec, -1.0);
+
+  // If we should solve overlapping segments of time in parallel instead of a single batch
+  std::vector<double> segment_prior_sigmas_default = {0.1, 0.1, 0.1, 0.01};
+  nh.param<bool>("use_segments", use_segments, false);
+  nh.param<double>("segment_sec", segment_sec, 60.0);
+  nh.param<double>("segment_overlap_sec", segment_overlap_sec, 5.0);
+  nh.param<int>("segment_num_consensus", segment_num_consensus, 2);
+  nh.param<std::vector<double>>("segment_prior_sigmas", segment_prior_sigmas, segment_prior_sigmas_default);
+  if (segment_prior_sigmas.size() != 4) {
+    ROS_ERROR("[VICON-GRAPH]: segment_prior_sigmas should be of size 4 (ori, pos, grav, toff)");
+    ROS_ERROR("%s on line %d", __FILE__, __LINE__);
+    std::exit(EXIT_FAILURE);
+  }
+
   // Nice debug print
   cout << "estimate_toff_vicon_to_imu: " << (int)config->estimate_vicon_imu_toff << endl;
   cout << "estimate_ori_vicon_to_imu: " << (int)config->estimate_vicon_imu_ori << endl;
   cout << "estimate_pos_vicon_to_imu: " << (int)config->estimate_vicon_imu_pos << endl;
+  cout << "vicon_cache_resolution: " << config->vicon_cache_resolution << endl;
   cout << "num_loop_relin: " << num_loop_relin << endl;
+  cout << "relin_bias_thresh_gyro: " << relin_bias_thresh_gyro << endl;
+  cout << "relin_bias_thresh_accel: " << relin_bias_thresh_accel << endl;
+  cout << "num_threads: " << num_threads << endl;
+  cout << "ordering_type: " << ordering_type << endl;
+  cout << "converge_pos_thresh: " << converge_pos_thresh << endl;
+  cout << "converge_ori_thresh: " << converge_ori_thresh << endl;
+  cout << "converge_toff_thresh: " << converge_toff_thresh << endl;
+  cout << "converge_lambda_thresh: " << converge_lambda_thresh << endl;
+  cout << "use_arrowhead_solver: " << (int)use_arrowhead_solver << endl;
+  cout << "output_freq: " << output_freq << endl;
+  cout << "save_binary: " << (int)save_binary << endl;
+  cout << "export_covariance: " << (int)export_covariance << endl;
+  cout << "use_isam2: " << (int)use_isam2 << endl;
+  cout << "isam2_chunk_sec: " << isam2_chunk_sec << endl;
+  cout << "isam2_lag_sec: " << isam2_lag_sec << endl;
+  cout << "use_segments: " << (int)use_segments << endl;
+  cout << "segment_sec: " << segment_sec << endl;
+  cout << "segment_overlap_sec: " << segment_overlap_sec << endl;
+  cout << "segment_num_consensus: " << segment_num_consensus << endl;
+  cout << "segment_prior_sigmas: " << segment_prior_sigmas.at(0) << ", " << segment_prior_sigmas.at(1) << ", "
+       << segment_prior_sigmas.at(2) << ", " << segment_prior_sigmas.at(3) << endl;
 
   // ================================================================================================
   // ================================================================================================
@@ -104,7 +191,7 @@ void ViconGraphSolver::build_and_solve() {
   }
 
   // Ensure we have enough measurements after removing invalid
-  if (interpolator->get_raw_poses().size() < 2) {
+  if (interpolator->get_num_poses() < 2) {
     ROS_ERROR("[VICON-GRAPH]: Not enough vicon poses to optimize with...");
     ROS_ERROR("[VICON-GRAPH]: Make sure your vicon topic is correct...");
     ROS_ERROR("%s on line %d", __FILE__, __LINE__);
@@ -114,32 +201,20 @@ void ViconGraphSolver::build_and_solve() {
   // Delete all camera measurements that occur before our IMU readings
   // Also delete ones before and after the first and last vicon measurements
   ROS_INFO("cleaning camera timestamps");
-  int ct_remove_imu = 0;
-  int ct_remove_before = 0;
-  int ct_remove_after = 0;
+  Profiler::Scope timer_clean(profiler, "clean_timestamps");
   double vicon_first_time_inI = interpolator->get_time_min() + init_toff_imu_to_vicon + 2 * TIME_OFFSET;
   double vicon_last_time_inI = interpolator->get_time_max() + init_toff_imu_to_vicon - 2 * TIME_OFFSET;
-  auto it0 = timestamp_cameras.begin();
-  while (it0 != timestamp_cameras.end()) {
+  std::vector<DroppedRange> dropped = StateGridPlanner::compact(timestamp_cameras, [&](double timestamp) -> DropReason {
     if (!ros::ok())
-      break;
-    if (!propagator->has_bounding_imu(*it0)) {
-      ROS_INFO_THROTTLE(0.05, "    - deleted cam time %.9f with no IMU [throttled]", *it0);
-      it0 = timestamp_cameras.erase(it0);
-      ct_remove_imu++;
-    } else if ((*it0) < vicon_first_time_inI) {
-      ROS_INFO_THROTTLE(0.05, "    - deleted cam time %.9f before first vicon [throttled]", *it0);
-      it0 = timestamp_cameras.erase(it0);
-      ct_remove_before++;
-    } else if ((*it0) > vicon_last_time_inI) {
-      ROS_INFO_THROTTLE(0.05, "    - deleted cam time %.9f after last vicon [throttled]", *it0);
-      it0 = timestamp_cameras.erase(it0);
-      ct_remove_after++;
-    } else {
-      it0++;
-    }
-  }
-  ROS_INFO("removed %d imu invalid, %d invalid before vicon, %d invalid after vicon", ct_remove_imu, ct_remove_before, ct_remove_after);
+      return DropReason::SHUTDOWN;
+    return planner->check_coverage(timestamp, vicon_first_time_inI, vicon_last_time_inI);
+  });
+  StateGridPlanner::print(dropped);
+  ROS_INFO("removed %d imu invalid, %d invalid before vicon, %d invalid after vicon",
+           (int)StateGridPlanner::count(dropped, DropReason::NO_IMU), (int)StateGridPlanner::count(dropped, DropReason::BEFORE_VICON),
+           (int)StateGridPlanner::count(dropped, DropReason::AFTER_VICON));
+  dropped_states.insert(dropped_states.end(), dropped.begin(), dropped.end());
+  timer_clean.stop();
 
   // Ensure we have enough measurements after removing invalid
   if (timestamp_cameras.empty()) {
@@ -150,12 +225,12 @@ void ViconGraphSolver::build_and_solve() {
   }
 
   // Clear old states
-  map_states.clear();
   values.clear();
 
-  // Create map of the state timestamps to their IDs
+  // Each state gets an ID from its position in the grid, this stays with it even if states before it get removed
+  state_ids.resize(timestamp_cameras.size());
   for (size_t i = 0; i < timestamp_cameras.size(); i++) {
-    map_states.insert({timestamp_cameras.at(i), i});
+    state_ids.at(i) = i;
   }
 
   // Loop a specified number of times, and keep solving the problem
@@ -163,27 +238,47 @@ void ViconGraphSolver::build_and_solve() {
   for (int i = 0; i <= num_loop_relin; i++) {
 
     // Build the problem
-    build_problem(i == 0);
+    // The incremental solver builds the factors of each chunk of time itself, so here we only need the states
+    Profiler::Scope timer_build(profiler, "build");
+    if (use_isam2 && !use_segments) {
+      build_states(i == 0);
+      graph->erase(graph->begin(), graph->end());
+      graph_ordering.clear();
+      graph_state_ids.clear();
+    } else {
+      build_problem(i == 0);
+    }
+    double time_build = timer_build.stop();
 
     // optimize the graph.
-    optimize_problem();
+    Profiler::Scope timer_optimize(profiler, "optimize");
+    monitor->start_loop();
+    if (use_segments) {
+      optimize_problem_segments();
+    } else if (use_isam2) {
+      optimize_problem_isam2();
+    } else {
+      optimize_problem();
+    }
+    double time_optimize = timer_optimize.stop();
 
     // move values forward in time
     values = values_result;
 
     // Now print timing statistics
-    ROS_INFO("\u001b[34m[TIME]: %.4f to build\u001b[0m", (rT2 - rT1).total_microseconds() * 1e-6);
-    ROS_INFO("\u001b[34m[TIME]: %.4f to optimize\u001b[0m", (rT3 - rT2).total_microseconds() * 1e-6);
-    ROS_INFO("\u001b[34m[TIME]: %.4f total (loop %d)\u001b[0m", (rT3 - rT1).total_microseconds() * 1e-6, i);
+    ROS_INFO("\u001b[34m[TIME]: %.4f to build\u001b[0m", time_build);
+    ROS_INFO("\u001b[34m[TIME]: %.4f to optimize\u001b[0m", time_optimize);
+    ROS_INFO("\u001b[34m[TIME]: %.4f total (loop %d)\u001b[0m", time_build + time_optimize, i);
 
     // Visualize this iteration
+    Profiler::Scope timer_visualize(profiler, "visualize");
     visualize();
   }
 
   // Debug print results...
   cout << endl << "======================================" << endl;
-  cout << "state_0: " << endl << values_result.at<JPLNavState>(X(map_states[timestamp_cameras.at(0)])) << endl;
-  cout << "state_N: " << endl << values_result.at<JPLNavState>(X(map_states[timestamp_cameras.at(timestamp_cameras.size() - 1)])) << endl;
+  cout << "state_0: " << endl << values_result.at<JPLNavState>(X(state_ids.at(0))) << endl;
+  cout << "state_N: " << endl << values_result.at<JPLNavState>(X(state_ids.at(state_ids.size() - 1))) << endl;
   cout << "R_BtoI: " << endl << quat_2_Rot(values_result.at<JPLQuaternion>(C(0)).q()) << endl << endl;
   cout << "p_BinI: " << endl << values_result.at<Vector3>(C(1)) << endl << endl;
   cout << "R_GtoV: " << endl << values_result.at<RotationXY>(G(0)).rot() << endl << endl;
@@ -191,10 +286,36 @@ void ViconGraphSolver::build_and_solve() {
   cout << "======================================" << endl << endl;
 }
 
+/**
+ * @brief Weighted average of a variable's estimate from many segments.
+ *
+ * The average is done in the tangent space about the reference value, so this works for any manifold type.
+ *
+ * @param key Variable we want to average
+ * @param ref Reference value we will linearize about
+ * @param results Optimized values of each segment
+ * @param weights Weight of each segment
+ * @return Averaged value
+ */
+template <typename VALUE>
+static VALUE average_segments(gtsam::Key key, const VALUE &ref, const std::vector<gtsam::Values> &results, const std::vector<double> &weights) {
+  typename traits<VALUE>::TangentVector xi;
+  xi.setZero();
+  double weight_sum = 0.0;
+  for (size_t s = 0; s < results.size(); s++) {
+    xi += weights.at(s) * traits<VALUE>::Local(ref, results.at(s).at<VALUE>(key));
+    weight_sum += weights.at(s);
+  }
+  if (weight_sum <= 0.0)
+    return ref;
+  return traits<VALUE>::Retract(ref, xi / weight_sum);
+}
+
 void ViconGraphSolver::write_to_file(std::string csvfilepath, std::string infofilepath) {
 
   // Debug info
   ROS_INFO("saving states and info to file");
+  Profiler::Scope timer_write(profiler, "write_to_file");
 
   // If the file exists, then delete it
   if (boost::filesystem::exists(csvfilepath)) {
@@ -211,27 +332,87 @@ void ViconGraphSolver::write_to_file(std::string csvfilepath, std::string infofi
   boost::filesystem::path p2(infofilepath);
   boost::filesystem::create_directories(p2.parent_path());
 
-  // Open our state file!
-  std::ofstream of_state;
-  of_state.open(csvfilepath, std::ofstream::out | std::ofstream::app);
-  of_state << "#time(ns),px,py,pz,qw,qx,qy,qz,vx,vy,vz,bwx,bwy,bwz,bax,bay,baz" << std::endl;
+  // Get the trajectory we will save, either our states or integrated between them at the output rate
+  std::vector<double> times_out;
+  std::vector<JPLNavState, Eigen::aligned_allocator<JPLNavState>> states_out;
+  if (output_freq > 0) {
+    get_dense_states(output_freq, times_out, states_out);
+    ROS_INFO("    - integrated %zu states at %.1f hz", times_out.size(), output_freq);
+  } else {
+    times_out = timestamp_cameras;
+    for (size_t i = 0; i < timestamp_cameras.size(); i++) {
+      states_out.push_back(values_result.at<JPLNavState>(X(state_ids.at(i))));
+    }
+  }
 
-  // Loop through all states, and
+  // Loop through all states, and get them at this timestep rotated into gravity aligned frame
   Eigen::Matrix3d R_GtoV = values_result.at<RotationXY>(G(0)).rot();
   Eigen::Vector4d q_GtoV = rot_2_quat(R_GtoV);
-  for (size_t i = 0; i < timestamp_cameras.size(); i++) {
-    // get this state at this timestep rotated into gravity aligned frame
-    JPLNavState state = values_result.at<JPLNavState>(X(map_states[timestamp_cameras.at(i)]));
+  std::vector<TrajectoryWriter::Row> rows(times_out.size());
+  for (size_t i = 0; i < times_out.size(); i++) {
+    const JPLNavState &state = states_out.at(i);
     Eigen::Vector4d q_GtoIi = quat_multiply(state.q(), q_GtoV);
     Eigen::Vector3d p_IiinG = R_GtoV.transpose() * state.p();
     Eigen::Vector3d v_IiinG = R_GtoV.transpose() * state.v();
-    // export to file (time(ns),px,py,pz,qw,qx,qy,qz,vx,vy,vz,bwx,bwy,bwz,bax,bay,baz)
-    of_state << std::setprecision(20) << std::floor(1e9 * timestamp_cameras.at(i)) << "," << std::setprecision(6) << p_IiinG(0) << ","
-             << p_IiinG(1) << "," << p_IiinG(2) << "," << q_GtoIi(3) << "," << q_GtoIi(0) << "," << q_GtoIi(1) << "," << q_GtoIi(2) << ","
-             << v_IiinG(0) << "," << v_IiinG(1) << "," << v_IiinG(2) << "," << state.bg()(0) << "," << state.bg()(1) << "," << state.bg()(2)
-             << "," << state.ba()(0) << "," << state.ba()(1) << "," << state.ba()(2) << std::endl;
+    // (px,py,pz,qw,qx,qy,qz,vx,vy,vz,bwx,bwy,bwz,bax,bay,baz)
+    rows.at(i) = {p_IiinG(0), p_IiinG(1), p_IiinG(2),    q_GtoIi(3),    q_GtoIi(0),    q_GtoIi(1),    q_GtoIi(2),    v_IiinG(0),
+                  v_IiinG(1), v_IiinG(2), state.bg()(0), state.bg()(1), state.bg()(2), state.ba()(0), state.ba()(1), state.ba()(2)};
+  }
+
+  // Write the states in the background while we do the rest
+  TrajectoryCalibration calib;
+  calib.q_BtoI = values_result.at<JPLQuaternion>(C(0)).q();
+  calib.p_BinI = values_result.at<Vector3>(C(1));
+  calib.R_GtoV = R_GtoV;
+  calib.gravity_magnitude = gravity_magnitude;
+  calib.toff_vicon_to_imu = values_result.at<Vector1>(T(0))(0);
+  std::string binfilepath = (save_binary) ? (p1.parent_path() / p1.stem()).string() + ".bin" : "";
+  TrajectoryWriter writer(num_threads);
+  writer.start(csvfilepath, binfilepath, std::move(times_out), std::move(rows), calib);
+
+  // Recover the covariances of the states and calibration, and save the states next to the state file
+  // These are in the same frame and order as the state file (p, theta, v, bw, ba), with the cross-covariance to the next state
+  // Orientation error is the left perturbation of q_GtoI, and the uncertainty of the gravity direction is not included
+  std::vector<Eigen::MatrixXd> cov_states, cov_states_next;
+  Eigen::MatrixXd cov_calib;
+  std::vector<gtsam::Key> calib_keys;
+  bool has_cov = export_covariance && compute_covariances(cov_states, cov_states_next, cov_calib, calib_keys);
+  if (has_cov) {
+    Eigen::Matrix<double, 15, 15> J = Eigen::Matrix<double, 15, 15>::Zero();
+    J.block(0, 12, 3, 3) = R_GtoV.transpose();
+    J.block(3, 0, 3, 3).setIdentity();
+    J.block(6, 6, 3, 3) = R_GtoV.transpose();
+    J.block(9, 3, 3, 3).setIdentity();
+    J.block(12, 9, 3, 3).setIdentity();
+    std::string covfilepath = (p1.parent_path() / p1.stem()).string() + "_cov.csv";
+    if (boost::filesystem::exists(covfilepath)) {
+      boost::filesystem::remove(covfilepath);
+      ROS_INFO("    - old covariance file found, deleted...");
+    }
+    std::ofstream of_cov;
+    of_cov.open(covfilepath, std::ofstream::out | std::ofstream::app);
+    of_cov << "#time(ns),P(15x15 row-major),P_next(15x15 row-major, cross-covariance with next state, zero for the last)" << std::endl;
+    for (size_t i = 0; i < timestamp_cameras.size(); i++) {
+      Eigen::Matrix<double, 15, 15> cov = J * cov_states.at(i) * J.transpose();
+      Eigen::Matrix<double, 15, 15> cov_next = Eigen::Matrix<double, 15, 15>::Zero();
+      if (i + 1 < timestamp_cameras.size())
+        cov_next = J * cov_states_next.at(i) * J.transpose();
+      of_cov << std::setprecision(20) << std::floor(1e9 * timestamp_cameras.at(i)) << std::setprecision(9);
+      for (int r = 0; r < 15; r++) {
+        for (int c = 0; c < 15; c++) {
+          of_cov << "," << cov(r, c);
+        }
+      }
+      for (int r = 0; r < 15; r++) {
+        for (int c = 0; c < 15; c++) {
+          of_cov << "," << cov_next(r, c);
+        }
+      }
+      of_cov << "\n";
+    }
+    of_cov.close();
+    ROS_INFO("    - saved covariances to %s", covfilepath.c_str());
   }
-  of_state.close();
 
   // Save calibration and the such to file
   std::ofstream of_info;
@@ -244,7 +425,136 @@ void ViconGraphSolver::write_to_file(std::string csvfilepath, std::string infofi
   of_info << values_result.at<RotationXY>(G(0)).thetax() << " " << values_result.at<RotationXY>(G(0)).thetax() << endl << endl;
   of_info << "gravity norm: " << endl << gravity_magnitude << endl << endl;
   of_info << "t_off_vicon_to_imu: " << endl << values_result.at<Vector1>(T(0)) << endl << endl;
+  if (has_cov) {
+    of_info << "calibration covariance (";
+    for (size_t i = 0; i < calib_keys.size(); i++) {
+      of_info << ((i > 0) ? ", " : "") << gtsam::DefaultKeyFormatter(calib_keys.at(i));
+    }
+    of_info << "): " << endl << cov_calib << endl << endl;
+  }
+  of_info << "dropped states (start, end, count, reason): " << endl;
+  for (const auto &range : dropped_states) {
+    of_info << std::setprecision(20) << range.time_start << ", " << range.time_end << std::setprecision(6) << ", " << range.count << ", "
+            << StateGridPlanner::reason_to_string(range.reason) << endl;
+  }
   of_info.close();
+
+  // Wait for our states to finish
+  if (!writer.wait()) {
+    ROS_WARN("unable to save states to %s", csvfilepath.c_str());
+  } else if (save_binary) {
+    ROS_INFO("    - saved binary states to %s", binfilepath.c_str());
+  }
+}
+
+void ViconGraphSolver::get_dense_states(double freq, std::vector<double> &times,
+                                        std::vector<JPLNavState, Eigen::aligned_allocator<JPLNavState>> &states) {
+
+  // Our output times are a grid from the first state, and we find the first output time in each interval
+  times.clear();
+  states.clear();
+  if (timestamp_cameras.size() < 2 || freq <= 0) {
+    return;
+  }
+  size_t num_out = (size_t)std::floor((timestamp_cameras.back() - timestamp_cameras.front()) * freq) + 1;
+  for (size_t j = 0; j < num_out; j++) {
+    times.push_back(std::min(timestamp_cameras.front() + (double)j / freq, timestamp_cameras.back()));
+  }
+  states.resize(times.size());
+  std::vector<size_t> interval_start(timestamp_cameras.size(), times.size());
+  for (size_t i = 0, j = 0; i < timestamp_cameras.size(); i++) {
+    while (j < times.size() && times.at(j) < timestamp_cameras.at(i))
+      j++;
+    interval_start.at(i) = j;
+  }
+
+  // Each interval is integrated forward from its starting state with its bias estimate
+  // The error we have at the next state is then blended in linearly over the interval, so we are continuous at every state
+  const Eigen::Vector3d grav_inV = gravity_magnitude * values_result.at<RotationXY>(G(0)).rot().col(2);
+  parallel_for(timestamp_cameras.size() - 1, num_threads, [&](size_t i) {
+    // Times we need in this interval (the last interval also has the last state time)
+    size_t j0 = interval_start.at(i);
+    size_t j1 = (i + 2 == timestamp_cameras.size()) ? times.size() : interval_start.at(i + 1);
+    if (j0 >= j1)
+      return;
+    const JPLNavState &state0 = values_result.at<JPLNavState>(X(state_ids.at(i)));
+    const JPLNavState &state1 = values_result.at<JPLNavState>(X(state_ids.at(i + 1)));
+    double time0 = timestamp_cameras.at(i);
+    double time1 = timestamp_cameras.at(i + 1);
+    const Eigen::Matrix3d R_GtoK = quat_2_Rot(state0.q());
+
+    // Integrate to each time, and to the next state
+    std::vector<double> times_int(times.begin() + j0, times.begin() + j1);
+    times_int.push_back(time1);
+    std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> integrations;
+    bool valid = propagator->propagate_dense(time0, times_int, state0.bg(), state0.ba(), integrations);
+
+    // Predict the state at each time (without IMU we just interpolate between the two states)
+    std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d>> R_pred(times_int.size());
+    std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d>> p_pred(times_int.size()), v_pred(times_int.size());
+    for (size_t k = 0; k < times_int.size(); k++) {
+      if (valid) {
+        const CpiV1 &preint = integrations.at(k);
+        double dt = times_int.at(k) - time0;
+        R_pred.at(k) = preint.R_k2tau * R_GtoK;
+        p_pred.at(k) = state0.p() + state0.v() * dt - 0.5 * grav_inV * dt * dt + R_GtoK.transpose() * preint.alpha_tau;
+        v_pred.at(k) = state0.v() - grav_inV * dt + R_GtoK.transpose() * preint.beta_tau;
+      } else {
+        R_pred.at(k) = R_GtoK;
+        p_pred.at(k) = state0.p();
+        v_pred.at(k) = state0.v();
+      }
+    }
+
+    // Correction we need at the next state, which we blend in over the interval
+    const Eigen::Vector3d dtheta = log_so3(quat_2_Rot(state1.q()) * R_pred.back().transpose());
+    const Eigen::Vector3d dp = state1.p() - p_pred.back();
+    const Eigen::Vector3d dv = state1.v() - v_pred.back();
+    for (size_t k = 0; k + 1 < times_int.size(); k++) {
+      double lambda = (times_int.at(k) - time0) / (time1 - time0);
+      Eigen::Matrix3d R_GtoI = exp_so3(lambda * dtheta) * R_pred.at(k);
+      Eigen::Vector3d bg = (1 - lambda) * state0.bg() + lambda * state1.bg();
+      Eigen::Vector3d ba = (1 - lambda) * state0.ba() + lambda * state1.ba();
+      states.at(j0 + k) =
+          JPLNavState(times_int.at(k), rot_2_quat(R_GtoI), bg, v_pred.at(k) + lambda * dv, ba, p_pred.at(k) + lambda * dp);
+    }
+  });
+}
+
+bool ViconGraphSolver::compute_covariances(std::vector<Eigen::MatrixXd> &cov_states, std::vector<Eigen::MatrixXd> &cov_states_next,
+                                           Eigen::MatrixXd &cov_calib, std::vector<gtsam::Key> &calib_keys) {
+
+  // The incremental solver never has the whole graph, so we can not recover the covariances from it
+  if (graph->empty()) {
+    ROS_WARN("[VICON-GRAPH]: no full graph (incremental solver), unable to recover covariances");
+    return false;
+  }
+
+  // Our information is a chain of states all connected to the calibration
+  // Thus we only need the blocks of its inverse which are non-zero, which is linear in the number of states
+  Profiler::Scope timer_cov(profiler, "covariance");
+  std::vector<gtsam::Key> state_keys = get_state_keys();
+  std::vector<size_t> state_dims, calib_dims;
+  for (const gtsam::Key &key : state_keys) {
+    state_dims.push_back(values_result.at(key).dim());
+  }
+  calib_keys.clear();
+  for (const gtsam::Key &key : graph->keys()) {
+    if (gtsam::Symbol(key).chr() == 'x')
+      continue;
+    calib_keys.push_back(key);
+    calib_dims.push_back(values_result.at(key).dim());
+  }
+  ArrowheadSolver solver(state_keys, state_dims, calib_keys, calib_dims);
+  if (!solver.add_graph(*linearize_graph(values_result))) {
+    ROS_WARN("[VICON-GRAPH]: graph is not a chain with calibration, unable to recover covariances");
+    return false;
+  }
+  if (!solver.marginal_covariances(cov_states, cov_states_next, cov_calib)) {
+    ROS_WARN("[VICON-GRAPH]: information is not positive definite, unable to recover covariances");
+    return false;
+  }
+  return true;
 }
 
 void ViconGraphSolver::visualize() {
@@ -258,7 +568,7 @@ void ViconGraphSolver::visualize() {
   for (size_t i = 0; i < timestamp_cameras.size(); i++) {
 
     // Get the optimized imu state
-    JPLNavState state = values_result.at<JPLNavState>(X(map_states[timestamp_cameras.at(i)]));
+    JPLNavState state = values_result.at<JPLNavState>(X(state_ids.at(i)));
 
     // Create the pose
     geometry_msgs::PoseStamped posetemp;
@@ -337,19 +647,23 @@ void ViconGraphSolver::visualize() {
   geometry_msgs::PoseArray pose_arr;
   pose_arr.header.stamp = ros::Time::now();
   pose_arr.header.frame_id = "vicon";
-  for (const auto &pose_data : interpolator->get_raw_poses()) {
-    if (last_pub_time != -1 && (last_pub_time + 1.0 / vicon_raw_pub_freq) > pose_data.timestamp)
+  for (size_t i = 0; i < interpolator->get_num_poses(); i++) {
+    double timestamp;
+    Eigen::Vector4d q_VtoB;
+    Eigen::Vector3d p_BinV;
+    interpolator->get_raw_pose(i, timestamp, q_VtoB, p_BinV);
+    if (last_pub_time != -1 && (last_pub_time + 1.0 / vicon_raw_pub_freq) > timestamp)
       continue;
     geometry_msgs::Pose pose;
-    pose.orientation.x = pose_data.q(0);
-    pose.orientation.y = pose_data.q(1);
-    pose.orientation.z = pose_data.q(2);
-    pose.orientation.w = pose_data.q(3);
-    pose.position.x = pose_data.p(0);
-    pose.position.y = pose_data.p(1);
-    pose.position.z = pose_data.p(2);
+    pose.orientation.x = q_VtoB(0);
+    pose.orientation.y = q_VtoB(1);
+    pose.orientation.z = q_VtoB(2);
+    pose.orientation.w = q_VtoB(3);
+    pose.position.x = p_BinV(0);
+    pose.position.y = p_BinV(1);
+    pose.position.z = p_BinV(2);
     pose_arr.poses.push_back(pose);
-    last_pub_time = pose_data.timestamp;
+    last_pub_time = timestamp;
   }
   pub_vicon_raw.publish(pose_arr);
 }
@@ -364,7 +678,7 @@ void ViconGraphSolver::get_imu_poses(std::vector<double> &times, std::vector<Eig
   for (size_t i = 0; i < timestamp_cameras.size(); i++) {
 
     // get this state at this timestep
-    JPLNavState state = values_result.at<JPLNavState>(X(map_states[timestamp_cameras.at(i)]));
+    JPLNavState state = values_result.at<JPLNavState>(X(state_ids.at(i)));
 
     // append to our vectors
     Eigen::Matrix<double, 10, 1> pose;
@@ -387,14 +701,86 @@ void ViconGraphSolver::get_calibration(double &toff, Eigen::Matrix3d &R_BtoI, Ei
   toff = values_result.at<Vector1>(T(0)).matrix()(0);
 }
 
+std::vector<size_t> ViconGraphSolver::get_state_indices() const {
+  size_t num_ids = (state_ids.empty()) ? 0 : state_ids.back() + 1;
+  std::vector<size_t> id_to_idx(num_ids, timestamp_cameras.size());
+  for (size_t i = 0; i < state_ids.size(); i++) {
+    id_to_idx.at(state_ids.at(i)) = i;
+  }
+  return id_to_idx;
+}
+
+size_t ViconGraphSolver::get_state_index(gtsam::Key key, const std::vector<size_t> &id_to_idx) const {
+  gtsam::Symbol symbol(key);
+  if (symbol.chr() != 'x' || symbol.index() >= id_to_idx.size())
+    return timestamp_cameras.size();
+  return id_to_idx.at(symbol.index());
+}
+
+gtsam::Ordering ViconGraphSolver::get_chain_ordering() const {
+  gtsam::KeySet keys = graph->keys();
+  gtsam::Ordering ordering;
+  for (size_t i = 0; i < state_ids.size(); i++) {
+    if (keys.find(X(state_ids.at(i))) != keys.end())
+      ordering.push_back(X(state_ids.at(i)));
+  }
+  std::vector<size_t> id_to_idx = get_state_indices();
+  for (const gtsam::Key &key : keys) {
+    if (get_state_index(key, id_to_idx) >= timestamp_cameras.size())
+      ordering.push_back(key);
+  }
+  return ordering;
+}
+
+std::vector<gtsam::Key> ViconGraphSolver::get_state_keys() const {
+  std::vector<gtsam::Key> keys;
+  for (size_t i = 0; i < state_ids.size(); i++) {
+    keys.push_back(X(state_ids.at(i)));
+  }
+  return keys;
+}
+
+gtsam::GaussianFactorGraph::shared_ptr ViconGraphSolver::linearize_graph(const gtsam::Values &values_lin) const {
+  // Each factor linearizes into its own slot, so the graph is the same as gtsam's serial one
+  auto linear = boost::make_shared<gtsam::GaussianFactorGraph>();
+  linear->resize(graph->size());
+  parallel_for(graph->size(), num_threads, [&](size_t i) {
+    const auto &factor = graph->at(i);
+    if (factor)
+      linear->replace(i, factor->linearize(values_lin));
+  });
+  return linear;
+}
+
+double ViconGraphSolver::graph_error(const gtsam::Values &values_eval) const {
+  // Factors are summed in fixed chunks, and then the chunks are summed in order
+  // Thus the rounding (and our LM accept / reject decisions) does not depend on the number of threads
+  const size_t chunk_size = 1024;
+  size_t num_chunks = (graph->size() + chunk_size - 1) / chunk_size;
+  std::vector<double> chunk_error(num_chunks, 0.0);
+  parallel_for(num_chunks, num_threads, [&](size_t c) {
+    size_t end = std::min((c + 1) * chunk_size, graph->size());
+    for (size_t i = c * chunk_size; i < end; i++) {
+      if (graph->at(i))
+        chunk_error.at(c) += graph->at(i)->error(values_eval);
+    }
+  });
+  double error = 0.0;
+  for (const double &err : chunk_error) {
+    error += err;
+  }
+  return error;
+}
+
 void ViconGraphSolver::build_problem(bool init_states) {
+  build_states(init_states);
+  build_factors(init_states);
+}
 
-  // Start timing
-  rT1 = boost::posix_time::microsec_clock::local_time();
+void ViconGraphSolver::build_states(bool init_states) {
 
-  // Clear the old factors
+  // Debug
   ROS_INFO("[BUILD]: building the graph (might take a while)");
-  graph->erase(graph->begin(), graph->end());
 
   // Create gravity and calibration nodes and insert them
   if (init_states) {
@@ -418,17 +804,18 @@ void ViconGraphSolver::build_problem(bool init_states) {
   // graph->add(factor_timemag);
   ROS_INFO("[BUILD]: current time offset is %.4f", values.at<Vector1>(T(0))(0));
 
-  // Loop through each camera time and construct the graph
-  auto it1 = timestamp_cameras.begin();
-  while (it1 != timestamp_cameras.end()) {
+  // Loop through each camera time and initialize the states
+  // States which do not have a vicon pose are removed here
+  Profiler::Scope timer_init(profiler, "build_init_states");
+  double time_first = (timestamp_cameras.empty()) ? 0.0 : timestamp_cameras.at(0);
+  std::vector<DroppedRange> dropped = StateGridPlanner::compact(timestamp_cameras, state_ids, [&](double timestamp_inI, size_t id) -> DropReason {
 
-    // If ros is wants us to stop, break out
-    if (!ros::ok())
-      break;
+    // If ros is wants us to stop, drop the states we have not reached, so we don't add factors to them below
+    if (!ros::ok()) {
+      return DropReason::SHUTDOWN;
+    }
 
     // Current image time
-    double timestamp_inI = *it1;
-    double time_from_start = timestamp_inI - timestamp_cameras.at(0);
     double timestamp_inV = timestamp_inI - values.at<Vector1>(T(0))(0);
 
     // First get the vicon pose at the current time
@@ -440,24 +827,18 @@ void ViconGraphSolver::build_problem(bool init_states) {
     bool has_vicon3 = interpolator->get_pose(timestamp_inV, q_VtoB, p_BinV, R_vicon);
 
     // Skip if we don't have a vicon measurement for this pose
+    // Also skip if we can't do the inverse of its covariance
+    DropReason reason = DropReason::NONE;
     if (!has_vicon1 || !has_vicon2 || !has_vicon3) {
-      ROS_WARN("    - skipping camera time %.9f - %.2f from beginning (no vicon pose found)", timestamp_inI, time_from_start);
-      if (values.find(X(map_states[timestamp_inI])) != values.end()) {
-        values.erase(X(map_states[timestamp_inI]));
-      }
-      it1 = timestamp_cameras.erase(it1);
-      continue;
+      reason = DropReason::NO_VICON_POSE;
+    } else if (std::isnan(R_vicon.norm()) || std::isnan(R_vicon.inverse().norm())) {
+      reason = DropReason::INVALID_VICON_COV;
     }
-
-    // Check if we can do the inverse
-    if (std::isnan(R_vicon.norm()) || std::isnan(R_vicon.inverse().norm())) {
-      ROS_WARN("    - skipping camera time %.9f - %.2f from beginning (R.norm = %.3f | Rinv.norm = %.3f)", timestamp_inI, time_from_start,
-               R_vicon.norm(), R_vicon.inverse().norm());
-      if (values.find(X(map_states[timestamp_inI])) != values.end()) {
-        values.erase(X(map_states[timestamp_inI]));
+    if (reason != DropReason::NONE) {
+      if (values.find(X(id)) != values.end()) {
+        values.erase(X(id));
       }
-      it1 = timestamp_cameras.erase(it1);
-      continue;
+      return reason;
     }
 
     // Now initialize the current pose of the IMU
@@ -479,33 +860,105 @@ void ViconGraphSolver::build_problem(bool init_states) {
 
       // Create the graph node
       JPLNavState imu_state(timestamp_inI, q_VtoI, bg, v_IinV, ba, p_IinV);
-      values.insert(X(map_states[timestamp_inI]), imu_state);
+      values.insert(X(id), imu_state);
     }
+    return DropReason::NONE;
+  });
 
-    // Add the vicon measurement to this pose
-    MeasBased_ViconPoseTimeoffsetFactor factor_vicon(X(map_states[timestamp_inI]), C(0), C(1), T(0), interpolator, config);
-    graph->add(factor_vicon);
+  // Report what states we have removed (relative to the first state)
+  for (const auto &range : dropped) {
+    ROS_WARN("    - skipping %d camera times %.2f to %.2f from beginning (%s)", (int)range.count, range.time_start - time_first,
+             range.time_end - time_first, StateGridPlanner::reason_to_string(range.reason).c_str());
+  }
+  dropped_states.insert(dropped_states.end(), dropped.begin(), dropped.end());
+  timer_init.stop();
+}
 
-    // Skip the first ever pose
-    if (it1 == timestamp_cameras.begin()) {
-      it1++;
+void ViconGraphSolver::build_factors(bool init_states) {
+
+  // Our cache of preintegrations, indexed by the ID of the state they start at
+  // We do a silly hack since inside of the propagator we create the preintegrator
+  // So we just randomly assign noises here which will be overwritten in the propagator
+  if (init_states) {
+    size_t num_ids = (state_ids.empty()) ? 0 : state_ids.back() + 1;
+    preint_cache.assign(num_ids, CpiV1(0, 0, 0, 0, true));
+    preint_cache_end.assign(num_ids, num_ids);
+  }
+
+  // Get the bias linearization point of each preintegration (the bias of the state at the start of the interval)
+  // If we have integrated this interval before, and the bias is still close to where we integrated it, we can re-use it
+  // The IMU factor corrects for the small change in bias using the bias Jacobians of the preintegration
+  Profiler::Scope timer_preint(profiler, "build_preintegration");
+  size_t num_preint = (timestamp_cameras.size() > 1) ? timestamp_cameras.size() - 1 : 0;
+  std::vector<size_t> relin_idx;
+  std::vector<double> relin_time0, relin_time1;
+  std::vector<Eigen::Vector3d> relin_bg, relin_ba;
+  for (size_t i = 0; i < num_preint; i++) {
+    size_t id0 = state_ids.at(i);
+    size_t id1 = state_ids.at(i + 1);
+    Eigen::Vector3d bg = values.at<JPLNavState>(X(id0)).bg();
+    Eigen::Vector3d ba = values.at<JPLNavState>(X(id0)).ba();
+    const CpiV1 &cached = preint_cache.at(id0);
+    if (preint_cache_end.at(id0) == id1 && (bg - cached.b_w_lin).norm() <= relin_bias_thresh_gyro &&
+        (ba - cached.b_a_lin).norm() <= relin_bias_thresh_accel) {
       continue;
     }
+    relin_idx.push_back(i);
+    relin_time0.push_back(timestamp_cameras.at(i));
+    relin_time1.push_back(timestamp_cameras.at(i + 1));
+    relin_bg.push_back(bg);
+    relin_ba.push_back(ba);
+  }
 
-    // Now add preintegration between this state and the next
-    // We do a silly hack since inside of the propagator we create the preintegrator
-    // So we just randomly assign noises here which will be overwritten in the propagator
-    double time0 = *(it1 - 1);
-    double time1 = *(it1);
+  // Now compute the preintegration of the intervals we need to
+  // Each of these is independent, thus the propagator computes them all in parallel
+  std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> relin_preints;
+  std::vector<char> relin_valid;
+  std::vector<char> preint_updated(num_preint, 0);
+  propagator->propagate_batch(relin_time0, relin_time1, relin_bg, relin_ba, num_threads, relin_preints, relin_valid);
+  for (size_t k = 0; k < relin_idx.size(); k++) {
+    size_t id0 = state_ids.at(relin_idx.at(k));
+    preint_updated.at(relin_idx.at(k)) = 1;
+    preint_cache.at(id0) = relin_preints.at(k);
+    preint_cache_end.at(id0) = (relin_valid.at(k)) ? state_ids.at(relin_idx.at(k) + 1) : preint_cache_end.size();
+  }
+  ROS_INFO("[BUILD]: integrated %d of %d imu intervals (others re-use their preintegration)", (int)relin_idx.size(), (int)num_preint);
+  timer_preint.stop();
+
+  // If our graph was already built on these same states, then we keep it
+  // The vicon factors interpolate when they are evaluated, thus only the IMU factors with a new preintegration need to be swapped
+  // Otherwise we clear the old factors and build it again (thus also need a new ordering)
+  Profiler::Scope timer_factors(profiler, "build_factors");
+  bool keep_graph = (!init_states && !graph->empty() && graph_state_ids == state_ids);
+  if (!keep_graph) {
+    graph->erase(graph->begin(), graph->end());
+    graph_ordering.clear();
+    imu_factor_idx.assign(num_preint, 0);
+  }
+  graph_state_ids = state_ids;
 
-    // Get the bias of the time0 state
-    Bias3 bg = values.at<JPLNavState>(X(map_states[time0])).bg();
-    Bias3 ba = values.at<JPLNavState>(X(map_states[time0])).ba();
+  // Finally add all our factors to the graph
+  // We add these in the same order as if we had built them serially
+  size_t num_imu_replaced = 0;
+  for (size_t i = 0; i < timestamp_cameras.size(); i++) {
+
+    // Add the vicon measurement to this pose
+    if (!keep_graph) {
+      MeasBased_ViconPoseTimeoffsetFactor factor_vicon(X(state_ids.at(i)), C(0), C(1), T(0), interpolator, config);
+      graph->add(factor_vicon);
+    }
+
+    // Skip the first ever pose
+    // Also skip if we already have the IMU factor for this preintegration
+    if (i == 0 || (keep_graph && !preint_updated.at(i - 1))) {
+      continue;
+    }
 
-    // Get the preintegrator (will get recreated with correct noises in propagator)
-    CpiV1 preint(0, 0, 0, 0, true);
-    bool has_imu = propagator->propagate(time0, time1, bg, ba, preint);
-    if (!has_imu || preint.DT != (time1 - time0)) {
+    // Preintegration between this state and the last
+    double time0 = timestamp_cameras.at(i - 1);
+    double time1 = timestamp_cameras.at(i);
+    const CpiV1 &preint = preint_cache.at(state_ids.at(i - 1));
+    if (preint_cache_end.at(state_ids.at(i - 1)) != state_ids.at(i) || preint.DT != (time1 - time0)) {
       ROS_ERROR("unable to get IMU readings, invalid preint\n");
       ROS_ERROR("preint.DT = %.3f | (time1-time0) = %.3f\n", preint.DT, time1 - time0);
       std::exit(EXIT_FAILURE);
@@ -524,15 +977,22 @@ void ViconGraphSolver::build_problem(bool init_states) {
     }
 
     // Now create the IMU factor
-    ImuFactorCPIv1 factor_imu(X(map_states[time0]), X(map_states[time1]), G(0), preint.P_meas, preint.DT, gravity_magnitude,
-                              preint.alpha_tau, preint.beta_tau, preint.q_k2tau, preint.b_a_lin, preint.b_w_lin, preint.J_q, preint.J_b,
-                              preint.J_a, preint.H_b, preint.H_a);
-    graph->add(factor_imu);
-
-    // Finally, move forward in time!
-    it1++;
+    // Either swap it into the place of the old one, or add it and remember where it is
+    auto factor_imu = boost::make_shared<ImuFactorCPIv1>(X(state_ids.at(i - 1)), X(state_ids.at(i)), G(0), preint.P_meas, preint.DT,
+                                                         gravity_magnitude, preint.alpha_tau, preint.beta_tau, preint.q_k2tau,
+                                                         preint.b_a_lin, preint.b_w_lin, preint.J_q, preint.J_b, preint.J_a, preint.H_b,
+                                                         preint.H_a);
+    if (keep_graph) {
+      graph->replace(imu_factor_idx.at(i - 1), factor_imu);
+      num_imu_replaced++;
+    } else {
+      imu_factor_idx.at(i - 1) = graph->size();
+      graph->push_back(factor_imu);
+    }
+  }
+  if (keep_graph) {
+    ROS_INFO("[BUILD]: kept the graph, replaced %d of %d imu factors", (int)num_imu_replaced, (int)num_preint);
   }
-  rT2 = boost::posix_time::microsec_clock::local_time();
 }
 
 void ViconGraphSolver::optimize_problem() {
@@ -541,30 +1001,466 @@ void ViconGraphSolver::optimize_problem() {
   ROS_INFO("[VICON-GRAPH]: graph factors - %d", (int)graph->nrFactors());
   ROS_INFO("[VICON-GRAPH]: graph nodes - %d", (int)graph->keys().size());
 
-  // Setup the optimizer (levenberg)
-  // Use METIS ordering to fix memory issue for large number of nodes
+  // Try our own solver first, this only fails if the graph is not a chain (then we use gtsam as normal)
+  if (use_arrowhead_solver) {
+    if (optimize_problem_arrowhead())
+      return;
+    ROS_WARN("[VICON-GRAPH]: graph is not a chain with calibration, falling back to gtsam solver");
+  }
+
+  // Use METIS by default, as it fixes memory issues compared to the default COLAMD for large number of nodes
   // See: https://bitbucket.org/gtborg/gtsam/issues/369/segfault-when-running-on-data-sets-with
+  // A time chain with the calibration last can also be used, which has no fill-in besides the calibration
+  // But the depth of its bayes tree grows with the number of states, so it has not been checked on long datasets
+  // This only depends on the structure of the graph, so we only compute it when the graph has been rebuilt
+  if (graph_ordering.empty()) {
+    Profiler::Scope timer_ordering(profiler, "optimize_ordering");
+    if (ordering_type == "metis") {
+      graph_ordering = Ordering::Create(Ordering::OrderingType::METIS, *graph);
+    } else {
+      graph_ordering = get_chain_ordering();
+    }
+  }
+
+  // Each step is solved with gtsam's multifrontal elimination of the damped system (same as its LM optimizer)
+  // The damping adds sqrt(lambda)*I on every variable, for which we need their dimensions
+  gtsam::GaussianFactorGraph::shared_ptr linear;
+  std::vector<std::pair<gtsam::Key, size_t>> key_dims;
+  for (const gtsam::Key &key : graph->keys()) {
+    key_dims.push_back({key, values.at(key).dim()});
+  }
+  auto set_system = [&](const gtsam::GaussianFactorGraph::shared_ptr &linear_new) {
+    linear = linear_new;
+    return true;
+  };
+  auto solve_step = [&](double lambda, gtsam::VectorValues &delta) {
+    gtsam::GaussianFactorGraph damped = *linear;
+    damped.reserve(damped.size() + key_dims.size());
+    for (const auto &key_dim : key_dims) {
+      size_t dim = key_dim.second;
+      damped.emplace_shared<gtsam::JacobianFactor>(key_dim.first, std::sqrt(lambda) * gtsam::Matrix::Identity(dim, dim),
+                                                   gtsam::Vector::Zero(dim), gtsam::noiseModel::Unit::Create(dim));
+    }
+    try {
+#ifdef GTSAM_USE_TBB
+      // Keep gtsam's parallel elimination to the number of threads we have been given
+      tbb::task_arena arena(num_threads);
+      arena.execute([&]() { delta = damped.optimize(graph_ordering); });
+#else
+      delta = damped.optimize(graph_ordering);
+#endif
+    } catch (const gtsam::IndeterminantLinearSystemException &) {
+      return false;
+    }
+    return true;
+  };
+  optimize_problem_lm("gtsam elimination", set_system, solve_step);
+}
+
+bool ViconGraphSolver::optimize_problem_arrowhead() {
+
+  // Our states are the chain in time order, everything else is a global variable
+  std::vector<gtsam::Key> chain_keys = get_state_keys(), global_keys;
+  std::vector<size_t> chain_dims, global_dims;
+  for (const gtsam::Key &key : chain_keys) {
+    chain_dims.push_back(values.at(key).dim());
+  }
+  for (const gtsam::Key &key : graph->keys()) {
+    if (gtsam::Symbol(key).chr() == 'x')
+      continue;
+    global_keys.push_back(key);
+    global_dims.push_back(values.at(key).dim());
+  }
+  ArrowheadSolver solver(chain_keys, chain_dims, global_keys, global_dims);
+
+  // Each linearization is added once to our normal equations, and then solved for each damping we try
+  auto set_system = [&](const gtsam::GaussianFactorGraph::shared_ptr &linear) {
+    solver.clear();
+    return solver.add_graph(*linear);
+  };
+  auto solve_step = [&](double lambda, gtsam::VectorValues &delta) { return solver.solve(lambda, delta); };
+  return optimize_problem_lm("arrowhead solver", set_system, solve_step);
+}
+
+bool ViconGraphSolver::optimize_problem_lm(const std::string &name,
+                                           const std::function<bool(const gtsam::GaussianFactorGraph::shared_ptr &)> &set_system,
+                                           const std::function<bool(double, gtsam::VectorValues &)> &solve_step) {
+
+  // Levenberg-Marquardt with the same settings as gtsam's optimizer
+  // Each iteration we linearize once (in parallel), and then increase the damping until we find a step which lowers the error
+  // The error of each step we try is also evaluated in parallel
+  const double lambda_lower = 0.0, lambda_upper = 1e20, lambda_factor = 10.0;
+  const double abs_tol = 1e-30, rel_tol = 1e-30;
+  const size_t max_iterations = 30;
+  double lambda = (last_lambda > 0) ? last_lambda : 1e-5;
+  std::vector<gtsam::Key> state_keys = get_state_keys();
+  gtsam::Values current = values;
+  double error_curr = graph_error(current);
+  double error_new = error_curr;
+  size_t iterations = 0;
+  ROS_INFO("[VICON-GRAPH]: begin optimization (%s)", name.c_str());
+  ROS_INFO("[VICON-GRAPH]: initial error = %.4f", error_curr);
+  while (iterations < max_iterations && ros::ok()) {
+    Profiler::Scope timer_iter(profiler, "optimize_iteration");
+    if (!set_system(linearize_graph(current))) {
+      return false;
+    }
+    bool success = false;
+    double lambda_step = lambda;
+    gtsam::Values values_before = current;
+    while (!success && lambda < lambda_upper) {
+      gtsam::VectorValues delta;
+      if (solve_step(lambda, delta)) {
+        gtsam::Values proposed = current.retract(delta);
+        double error_proposed = graph_error(proposed);
+        if (std::isfinite(error_proposed) && error_proposed <= error_curr) {
+          current = proposed;
+          error_new = error_proposed;
+          lambda_step = lambda;
+          lambda = std::max(lambda / lambda_factor, lambda_lower);
+          success = true;
+          break;
+        }
+      }
+      lambda *= lambda_factor;
+    }
+    timer_iter.stop();
+    iterations++;
+    if (success) {
+      monitor->update((int)iterations, error_new, lambda_step, true, state_keys, values_before, current);
+    }
+    if (monitor->converged()) {
+      ROS_INFO("[VICON-GRAPH]: converged, no state or calibration moved more than the thresholds");
+      break;
+    }
+    if (!success || checkConvergence(rel_tol, abs_tol, 0.0, error_curr, error_new)) {
+      break;
+    }
+    error_curr = error_new;
+  }
+  values_result = current;
+  last_lambda = lambda;
+  ROS_INFO("[VICON-GRAPH]: done optimization (%d iterations, error = %.4f)!", (int)iterations, error_new);
+  return true;
+}
+
+void ViconGraphSolver::build_chunk_factors(size_t idx0, size_t idx1, gtsam::NonlinearFactorGraph &factors) const {
+
+  // Preintegrate each interval which ends at a state in this chunk, at the current bias estimate of the state it starts at
+  std::vector<size_t> preint_idx;
+  std::vector<double> preint_time0, preint_time1;
+  std::vector<Eigen::Vector3d> preint_bg, preint_ba;
+  for (size_t i = std::max(idx0, (size_t)1); i < idx1; i++) {
+    const JPLNavState &state0 = values.at<JPLNavState>(X(state_ids.at(i - 1)));
+    preint_idx.push_back(i);
+    preint_time0.push_back(timestamp_cameras.at(i - 1));
+    preint_time1.push_back(timestamp_cameras.at(i));
+    preint_bg.push_back(state0.bg());
+    preint_ba.push_back(state0.ba());
+  }
+  std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> preints;
+  std::vector<char> preints_valid;
+  propagator->propagate_batch(preint_time0, preint_time1, preint_bg, preint_ba, num_threads, preints, preints_valid);
+
+  // Add the factors in the same order as build_factors() does
+  size_t k = 0;
+  for (size_t i = idx0; i < idx1; i++) {
+    factors.add(MeasBased_ViconPoseTimeoffsetFactor(X(state_ids.at(i)), C(0), C(1), T(0), interpolator, config));
+    if (i == 0)
+      continue;
+    const CpiV1 &preint = preints.at(k);
+    if (!preints_valid.at(k) || preint.DT != (timestamp_cameras.at(i) - timestamp_cameras.at(i - 1))) {
+      ROS_ERROR("unable to get IMU readings, invalid preint\n");
+      ROS_ERROR("preint.DT = %.3f | (time1-time0) = %.3f\n", preint.DT, timestamp_cameras.at(i) - timestamp_cameras.at(i - 1));
+      std::exit(EXIT_FAILURE);
+    }
+    if (std::isnan(preint.P_meas.norm()) || std::isnan(preint.P_meas.inverse().norm())) {
+      ROS_ERROR("R_imu is NAN | R.norm = %.3f | Rinv.norm = %.3f\n", preint.P_meas.norm(), preint.P_meas.inverse().norm());
+      ROS_ERROR("THIS SHOULD NEVER HAPPEN!@#!@#!@#!@#!#@\n");
+      std::exit(EXIT_FAILURE);
+    }
+    factors.push_back(boost::make_shared<ImuFactorCPIv1>(X(state_ids.at(i - 1)), X(state_ids.at(i)), G(0), preint.P_meas, preint.DT,
+                                                         gravity_magnitude, preint.alpha_tau, preint.beta_tau, preint.q_k2tau,
+                                                         preint.b_a_lin, preint.b_w_lin, preint.J_q, preint.J_b, preint.J_a, preint.H_b,
+                                                         preint.H_a));
+    k++;
+  }
+}
+
+void ViconGraphSolver::optimize_problem_isam2() {
+
+  // Find what chunk of time each state is in, each chunk is a range of state indices [idx0, idx1)
+  // The first chunk will also have all the calibration nodes
+  // NOTE: we do not have a full graph here, each chunk's factors are built once we reach it and given to isam2
+  // NOTE: thus with a lag, the factors and preintegrations we hold are bounded by the chunk and lag length
+  double chunk_sec = std::max(isam2_chunk_sec, 1e-3);
+  std::vector<std::pair<size_t, size_t>> chunk_idx;
+  for (size_t i = 0; i < timestamp_cameras.size(); i++) {
+    size_t chunk = (size_t)std::floor((timestamp_cameras.at(i) - timestamp_cameras.at(0)) / chunk_sec);
+    if (chunk_idx.size() < chunk + 1)
+      chunk_idx.resize(chunk + 1, {i, i});
+    chunk_idx.at(chunk).second = i + 1;
+  }
+  ROS_INFO("[VICON-GRAPH]: graph nodes - %d", (int)timestamp_cameras.size() + 4);
+
+  // Setup the optimizer
+  // We relinearize every update as our calibration is connected to every state
+  ISAM2Params isam_params;
+  isam_params.relinearizeThreshold = 0.01;
+  isam_params.relinearizeSkip = 1;
+  ISAM2 isam(isam_params);
+
+  // States we have not marginalized will be overwritten with the latest estimate
+  // While marginalized ones will keep their estimate from when they got removed
+  values_result = values;
+
+  // Now add each chunk of time, and solve it
+  ROS_INFO("[VICON-GRAPH]: begin incremental optimization (%d chunks)", (int)chunk_idx.size());
+  std::deque<gtsam::Key> states_active;
+  for (size_t c = 0; c < chunk_idx.size(); c++) {
+
+    // If ros is wants us to stop, break out
+    if (!ros::ok())
+      break;
+
+    // Get the new nodes for this chunk
+    gtsam::Values new_values;
+    if (c == 0) {
+      new_values.insert(C(0), values.at(C(0)));
+      new_values.insert(C(1), values.at(C(1)));
+      new_values.insert(G(0), values.at(G(0)));
+      new_values.insert(T(0), values.at(T(0)));
+    }
+    for (size_t i = chunk_idx.at(c).first; i < chunk_idx.at(c).second; i++) {
+      gtsam::Key key = X(state_ids.at(i));
+      new_values.insert(key, values.at(key));
+      states_active.push_back(key);
+    }
+
+    // Find the states which are outside of our lag and should be removed
+    // We constrain these to be eliminated first, so they will be leaves in the bayes tree
+    FastList<gtsam::Key> states_marg;
+    if (isam2_lag_sec > 0 && chunk_idx.at(c).first < chunk_idx.at(c).second) {
+      double time_newest = timestamp_cameras.at(chunk_idx.at(c).second - 1);
+      while (!states_active.empty() && values.at<JPLNavState>(states_active.front()).time() < time_newest - isam2_lag_sec) {
+        states_marg.push_back(states_active.front());
+        states_active.pop_front();
+      }
+    }
+    boost::optional<FastMap<gtsam::Key, int>> constrained_keys = boost::none;
+    if (!states_marg.empty()) {
+      constrained_keys = FastMap<gtsam::Key, int>();
+      for (const auto &key : isam.getLinearizationPoint().keys())
+        constrained_keys->insert({key, 1});
+      for (const auto &key : new_values.keys())
+        constrained_keys->insert({key, 1});
+      for (const auto &key : states_marg)
+        (*constrained_keys)[key] = 0;
+    }
+
+    // Build the factors of this chunk, each is added when its newest state is added
+    Profiler::Scope timer_build(profiler, "build_isam2_chunk");
+    gtsam::NonlinearFactorGraph chunk_factors;
+    build_chunk_factors(chunk_idx.at(c).first, chunk_idx.at(c).second, chunk_factors);
+    timer_build.stop();
+
+    // Add them to the problem, after this isam2 holds the only copy of the factors
+    Profiler::Scope timer_chunk(profiler, "optimize_isam2_chunk");
+    isam.update(chunk_factors, new_values, FactorIndices(), constrained_keys);
+    values_result.update(isam.calculateEstimate());
+
+    // Marginalize the old states, we just keep the current estimate if this fails
+    if (!states_marg.empty()) {
+      try {
+        isam.marginalizeLeaves(states_marg);
+      } catch (const std::exception &e) {
+        ROS_WARN("[VICON-GRAPH]: unable to marginalize %d states (%s)", (int)states_marg.size(), e.what());
+        for (const auto &key : states_marg)
+          states_active.push_back(key);
+        std::sort(states_active.begin(), states_active.end());
+      }
+    }
+
+    timer_chunk.stop();
+
+    // Publish what we have so far
+    ROS_INFO("[VICON-GRAPH]: chunk %d of %d | %d factors | %d active states", (int)c + 1, (int)chunk_idx.size(),
+             (int)chunk_factors.size(), (int)states_active.size());
+    visualize();
+  }
+
+  // Finally do a few more updates so the whole trajectory gets relinearized
+  for (int i = 0; i < 30 && ros::ok(); i++) {
+    isam.update();
+  }
+  values_result.update(isam.calculateEstimate());
+  ROS_INFO("[VICON-GRAPH]: done incremental optimization!");
+}
+
+void ViconGraphSolver::optimize_problem_segments() {
+
+  // Debug
+  ROS_INFO("[VICON-GRAPH]: graph factors - %d", (int)graph->nrFactors());
+  ROS_INFO("[VICON-GRAPH]: graph nodes - %d", (int)graph->keys().size());
+
+  // Split our states into overlapping segments of time
+  // The last segment is extended to the end if the remainder would be too short to solve on its own
+  // Since the overlap is at most half the segment, each state will be in at most two segments
+  double seg_len = std::max(segment_sec, 1.0);
+  double seg_overlap = std::min(std::max(segment_overlap_sec, 0.0), 0.5 * seg_len);
+  double time_start = timestamp_cameras.front();
+  double time_end = timestamp_cameras.back();
+  std::vector<std::pair<double, double>> seg_times;
+  double seg_t0 = time_start;
+  while (true) {
+    double seg_t1 = seg_t0 + seg_len;
+    if (seg_t1 + 0.5 * seg_len >= time_end) {
+      seg_times.push_back({seg_t0, time_end});
+      break;
+    }
+    seg_times.push_back({seg_t0, seg_t1});
+    seg_t0 += seg_len - seg_overlap;
+  }
+
+  // Range of state indices each segment has [idx0, idx1)
+  size_t num_seg = seg_times.size();
+  std::vector<std::pair<size_t, size_t>> seg_idx(num_seg);
+  for (size_t s = 0; s < num_seg; s++) {
+    auto it0 = std::lower_bound(timestamp_cameras.begin(), timestamp_cameras.end(), seg_times.at(s).first);
+    auto it1 = std::upper_bound(timestamp_cameras.begin(), timestamp_cameras.end(), seg_times.at(s).second);
+    seg_idx.at(s) = {(size_t)(it0 - timestamp_cameras.begin()), (size_t)(it1 - timestamp_cameras.begin())};
+  }
+
+  // Neighboring segments need to share at least one state, otherwise the factors between them would be in neither
+  // This can happen if the overlap is smaller than the time between two states (e.g. zero)
+  for (size_t s = 1; s < num_seg; s++) {
+    if (seg_idx.at(s - 1).second > 0)
+      seg_idx.at(s).first = std::min(seg_idx.at(s).first, seg_idx.at(s - 1).second - 1);
+  }
+
+  // Each factor belongs to every segment that has all of its states
+  // The vicon factors cache their measurement, so each segment gets its own copy to be thread safe
+  std::vector<size_t> id_to_idx = get_state_indices();
+  std::vector<gtsam::NonlinearFactorGraph> seg_graphs(num_seg);
+  size_t num_unassigned = 0;
+  for (const auto &factor : *graph) {
+    size_t idx_min = timestamp_cameras.size();
+    size_t idx_max = 0;
+    for (const auto &key : factor->keys()) {
+      size_t idx = get_state_index(key, id_to_idx);
+      if (idx >= timestamp_cameras.size())
+        continue;
+      idx_min = std::min(idx_min, idx);
+      idx_max = std::max(idx_max, idx);
+    }
+    if (idx_min > idx_max)
+      continue;
+    auto factor_vicon = boost::dynamic_pointer_cast<MeasBased_ViconPoseTimeoffsetFactor>(factor);
+    bool assigned = false;
+    for (size_t s = 0; s < num_seg; s++) {
+      if (idx_min < seg_idx.at(s).first || idx_max >= seg_idx.at(s).second)
+        continue;
+      if (factor_vicon) {
+        seg_graphs.at(s).add(MeasBased_ViconPoseTimeoffsetFactor(*factor_vicon));
+      } else {
+        seg_graphs.at(s).push_back(factor);
+      }
+      assigned = true;
+    }
+    num_unassigned += (assigned) ? 0 : 1;
+  }
+  if (num_unassigned > 0) {
+    ROS_WARN("[VICON-GRAPH]: %d factors span more than a single segment and will not be used", (int)num_unassigned);
+  }
+
+  // Initial values of each segment, and their weight in the calibration average
+  gtsam::Values calib;
+  calib.insert(C(0), values.at(C(0)));
+  calib.insert(C(1), values.at(C(1)));
+  calib.insert(G(0), values.at(G(0)));
+  calib.insert(T(0), values.at(T(0)));
+  std::vector<gtsam::Values> seg_results(num_seg);
+  std::vector<double> seg_weights(num_seg);
+  for (size_t s = 0; s < num_seg; s++) {
+    seg_results.at(s).insert(calib);
+    for (size_t i = seg_idx.at(s).first; i < seg_idx.at(s).second; i++) {
+      gtsam::Key key = X(state_ids.at(i));
+      seg_results.at(s).insert(key, values.at(key));
+    }
+    seg_weights.at(s) = (double)(seg_idx.at(s).second - seg_idx.at(s).first);
+  }
+
+  // Setup the optimizer (levenberg)
+  // Each segment is small so we can just use the default ordering
   LevenbergMarquardtParams opti_config;
-  opti_config.verbosity = NonlinearOptimizerParams::Verbosity::TERMINATION;
-  // config.verbosityLM = LevenbergMarquardtParams::VerbosityLM::SUMMARY;
-  // config.verbosityLM = LevenbergMarquardtParams::VerbosityLM::TERMINATION;
-  opti_config.orderingType = Ordering::OrderingType::METIS;
+  opti_config.verbosity = NonlinearOptimizerParams::Verbosity::SILENT;
   opti_config.absoluteErrorTol = 1e-30;
   opti_config.relativeErrorTol = 1e-30;
   opti_config.lambdaUpperBound = 1e20;
   opti_config.maxIterations = 30;
-  LevenbergMarquardtOptimizer optimizer(*graph, values, opti_config);
-
-  // Setup optimizer (dogleg)
-  // DoglegParams params;
-  // params.verbosity = NonlinearOptimizerParams::Verbosity::TERMINATION;
-  // params.relativeErrorTol = 1e-10;
-  // params.absoluteErrorTol = 1e-10;
-  // DoglegOptimizer optimizer(*graph, values, params);
-
-  // Perform the optimization
-  ROS_INFO("[VICON-GRAPH]: begin optimization");
-  values_result = optimizer.optimize();
-  ROS_INFO("[VICON-GRAPH]: done optimization (%d iterations)!", (int)optimizer.iterations());
-  rT3 = boost::posix_time::microsec_clock::local_time();
+
+  // Solves all segments in parallel, with a prior of the given sigmas on the current calibration
+  auto solve_segments = [&](const std::vector<double> &sigmas) {
+    parallel_for(num_seg, num_threads, [&](size_t s) {
+      if (seg_idx.at(s).first >= seg_idx.at(s).second)
+        return;
+      gtsam::NonlinearFactorGraph seg_graph = seg_graphs.at(s);
+      seg_graph.add(PriorFactor<JPLQuaternion>(C(0), calib.at<JPLQuaternion>(C(0)), noiseModel::Isotropic::Sigma(3, sigmas.at(0))));
+      seg_graph.add(PriorFactor<Vector3>(C(1), calib.at<Vector3>(C(1)), noiseModel::Isotropic::Sigma(3, sigmas.at(1))));
+      seg_graph.add(PriorFactor<RotationXY>(G(0), calib.at<RotationXY>(G(0)), noiseModel::Isotropic::Sigma(2, sigmas.at(2))));
+      seg_graph.add(PriorFactor<Vector1>(T(0), calib.at<Vector1>(T(0)), noiseModel::Isotropic::Sigma(1, sigmas.at(3))));
+      Profiler::Scope timer_segment(profiler, "optimize_segment");
+      LevenbergMarquardtOptimizer optimizer(seg_graph, seg_results.at(s), opti_config);
+      seg_results.at(s) = optimizer.optimize();
+    });
+  };
+
+  // Solve all segments, then average their calibration
+  // This average is then the prior on the calibration for the next pass
+  ROS_INFO("[VICON-GRAPH]: begin segment optimization (%d segments)", (int)num_seg);
+  for (int loop = 0; loop < std::max(segment_num_consensus, 1); loop++) {
+    if (!ros::ok())
+      break;
+    solve_segments(segment_prior_sigmas);
+    calib.update(C(0), average_segments<JPLQuaternion>(C(0), calib.at<JPLQuaternion>(C(0)), seg_results, seg_weights));
+    calib.update(C(1), average_segments<Vector3>(C(1), calib.at<Vector3>(C(1)), seg_results, seg_weights));
+    calib.update(G(0), average_segments<RotationXY>(G(0), calib.at<RotationXY>(G(0)), seg_results, seg_weights));
+    calib.update(T(0), average_segments<Vector1>(T(0), calib.at<Vector1>(T(0)), seg_results, seg_weights));
+    ROS_INFO("[VICON-GRAPH]: consensus pass %d | toff %.6f", loop, calib.at<Vector1>(T(0))(0));
+  }
+
+  // Each segment's states were solved with its own calibration, not the average we will save
+  // So we do a last pass with the calibration held at the average (by a very tight prior) so the states agree with it
+  if (ros::ok()) {
+    solve_segments(std::vector<double>(4, 1e-6));
+  }
+
+  // Stitch the states together
+  // Over an overlap we blend linearly from one segment to the next (i.e. weight by distance into each segment)
+  values_result = values;
+  values_result.update(calib);
+  for (size_t i = 0; i < timestamp_cameras.size(); i++) {
+    double timestamp = timestamp_cameras.at(i);
+    gtsam::Key key = X(state_ids.at(i));
+    bool has_ref = false;
+    JPLNavState state_ref;
+    Vector15 xi = Vector15::Zero();
+    double weight_sum = 0.0;
+    for (size_t s = 0; s < num_seg; s++) {
+      if (i < seg_idx.at(s).first || i >= seg_idx.at(s).second)
+        continue;
+      JPLNavState state = seg_results.at(s).at<JPLNavState>(key);
+      if (!has_ref) {
+        state_ref = state;
+        has_ref = true;
+      }
+      double weight = std::max(std::min(timestamp - seg_times.at(s).first, seg_times.at(s).second - timestamp), 1e-9);
+      xi += weight * state_ref.localCoordinates(state);
+      weight_sum += weight;
+    }
+    if (has_ref) {
+      values_result.update(key, state_ref.retract(xi / weight_sum));
+    }
+  }
+  ROS_INFO("[VICON-GRAPH]: done segment optimization!");
 }
@@ -20,18 +20,22 @@
 #define VICONGRAPHSOLVER_H
 
 #include <Eigen/Eigen>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <nav_msgs/Path.h>
 #include <ros/ros.h>
 #include <vector>
 
+#include <gtsam/config.h>
 #include <gtsam/inference/Symbol.h>
+#include <gtsam/linear/GaussianFactorGraph.h>
+#include <gtsam/linear/linearExceptions.h>
 #include <gtsam/nonlinear/DoglegOptimizer.h>
 #include <gtsam/nonlinear/ISAM2.h>
 #include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
-#include <gtsam/nonlinear/Marginals.h>
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/Values.h>
 #include <gtsam/slam/PriorFactor.h>
@@ -45,11 +49,21 @@
 #include "gtsam/RotationXY.h"
 #include "meas/Interpolator.h"
 #include "meas/Propagator.h"
+#include "solver/ArrowheadSolver.h"
+#include "solver/ConvergenceMonitor.h"
+#include "solver/StateGridPlanner.h"
+#include "solver/TrajectoryWriter.h"
+#include "utils/parallel.h"
+#include "utils/profiler.h"
 #include "utils/quat_ops.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem.hpp>
 
+#ifdef GTSAM_USE_TBB
+#include <tbb/task_arena.h>
+#endif
+
 using namespace std;
 using namespace gtsam;
 
@@ -67,9 +81,10 @@ public:
    * @param propagator Propagator with all IMU measurements inside
    * @param interpolator Interpolator with all vicon poses inside
    * @param timestamp_cameras Timestamps we are interested in estimating
+   * @param profiler Profiler we will record the timing of each phase into (will create our own if null)
    */
   ViconGraphSolver(ros::NodeHandle &nh, std::shared_ptr<Propagator> propagator, std::shared_ptr<Interpolator> interpolator,
-                   std::vector<double> timestamp_cameras);
+                   std::vector<double> timestamp_cameras, std::shared_ptr<Profiler> profiler = nullptr);
 
   /**
    * @brief This will build the graph and solve it.
@@ -83,6 +98,12 @@ public:
    * The CSV file will be in the eth format:
    * `(time(ns),px,py,pz,qw,qx,qy,qz,vx,vy,vz,bwx,bwy,bwz,bax,bay,baz)`
    *
+   * If an output rate is set, the states are integrated to it with get_dense_states() first.
+   * The states are written on a background thread (see TrajectoryWriter), and optionally also to a binary file `<csvfilepath stem>.bin`.
+   * If enabled, the covariance of each state is saved next to it in `<csvfilepath stem>_cov.csv`.
+   * Each row is the time and then the 15x15 covariance and cross-covariance with the next state (row-major), in the same order as the
+   * state file `(p,theta,v,bw,ba)`. The calibration covariance is saved in the info file.
+   *
    * @param csvfilepath CSV export file we want to save
    * @param infofilepath Txt file we will save the found calibration parameters
    */
@@ -109,6 +130,12 @@ public:
    */
   void get_calibration(double &toff, Eigen::Matrix3d &R_BtoI, Eigen::Vector3d &p_BinI, Eigen::Matrix3d &R_GtoV);
 
+  /// Profiler with the timing of each phase we have run
+  std::shared_ptr<Profiler> get_profiler() { return profiler; }
+
+  /// Monitor with the change of our estimate each optimizer iteration
+  std::shared_ptr<ConvergenceMonitor> get_convergence_monitor() { return monitor; }
+
 protected:
   /**
    * @brief This will build the graph problem and add all measurements and nodes to it
@@ -118,14 +145,148 @@ protected:
    */
   void build_problem(bool init_states);
 
+  /**
+   * @brief Creates or updates the states of the problem (the first half of build_problem())
+   * @param init_states If true we will init the states using the VICON, otherwise we keep the current estimates
+   */
+  void build_states(bool init_states);
+
+  /**
+   * @brief Preintegrates the IMU and adds all factors to the graph (the second half of build_problem())
+   * @param init_states If true the states were just created, so the graph can not be kept
+   */
+  void build_factors(bool init_states);
+
+  /**
+   * @brief Builds the factors of a range of states, used by the incremental solver in place of the full graph
+   *
+   * Each state gets its vicon factor, and the IMU factor to the state before it (if any).
+   * The IMU is preintegrated at the current bias estimate and not cached, so this only holds memory for the given range.
+   *
+   * @param idx0 Index of the first state in this range
+   * @param idx1 One past the index of the last state in this range
+   * @param factors Graph we will add the factors to
+   */
+  void build_chunk_factors(size_t idx0, size_t idx1, gtsam::NonlinearFactorGraph &factors) const;
+
+  /**
+   * @brief Gets the index of each state in timestamp_cameras, indexed by its ID
+   * IDs of states which have been removed will map to the number of states.
+   */
+  std::vector<size_t> get_state_indices() const;
+
+  /**
+   * @brief Gets the index of a state in timestamp_cameras from its graph key
+   * @param key Key of the node in the graph
+   * @param id_to_idx Result of get_state_indices()
+   * @return Index of the state, or the number of states if this key is not a valid state
+   */
+  size_t get_state_index(gtsam::Key key, const std::vector<size_t> &id_to_idx) const;
+
+  /**
+   * @brief Gets the elimination ordering of our graph as a chain
+   * States are eliminated in time order, and then all other variables (i.e. calibration) are eliminated last.
+   */
+  gtsam::Ordering get_chain_ordering() const;
+
+  /**
+   * @brief Gets our optimized trajectory at a given rate, by integrating the IMU between our states.
+   *
+   * Output times are a grid at the rate starting from the first state.
+   * Each interval is integrated from its state with its estimated biases, and the error to the next state is blended in linearly.
+   * Thus the trajectory passes through our states, while having the motion of the IMU in between them.
+   *
+   * @param freq Rate we want the trajectory at (hz)
+   * @param times Time of each output state
+   * @param states Output states in the vicon frame
+   */
+  void get_dense_states(double freq, std::vector<double> &times, std::vector<JPLNavState, Eigen::aligned_allocator<JPLNavState>> &states);
+
+  /**
+   * @brief Recovers the marginal covariances of our optimized states and calibration
+   * @param cov_states Covariance of each state (in its tangent space)
+   * @param cov_states_next Cross-covariance of each state with the next one
+   * @param cov_calib Covariance of all calibration variables
+   * @param calib_keys Keys of the calibration variables, in the order they are in cov_calib
+   * @return False if the graph is not a chain, or it is not positive definite
+   */
+  bool compute_covariances(std::vector<Eigen::MatrixXd> &cov_states, std::vector<Eigen::MatrixXd> &cov_states_next,
+                           Eigen::MatrixXd &cov_calib, std::vector<gtsam::Key> &calib_keys);
+
+  /// Gets the graph key of each state, in time order
+  std::vector<gtsam::Key> get_state_keys() const;
+
+  /**
+   * @brief Linearizes all factors of our graph in parallel
+   * @param values_lin Values we will linearize at
+   * @return Linear graph, with each factor in the same slot as its non-linear one
+   */
+  gtsam::GaussianFactorGraph::shared_ptr linearize_graph(const gtsam::Values &values_lin) const;
+
+  /**
+   * @brief Evaluates the error of our graph in parallel
+   * The sum is done in fixed chunks, so the result is the same for any number of threads.
+   * @param values_eval Values we will evaluate at
+   * @return Total error of the graph (0.5 * whitened squared residual)
+   */
+  double graph_error(const gtsam::Values &values_eval) const;
+
   /**
    * @brief This will optimize the graph.
-   * Uses Levenberg-Marquardt for the optimization.
+   * Uses Levenberg-Marquardt for the optimization, with each step solved by gtsam's multifrontal elimination.
    */
   void optimize_problem();
 
-  // Timing variables
-  boost::posix_time::ptime rT1, rT2, rT3, rT4, rT5, rT6, rT7;
+  /**
+   * @brief This will optimize the graph with our own linear solver.
+   *
+   * Uses Levenberg-Marquardt, but each step is solved with ArrowheadSolver which is linear in the number of states.
+   * This requires every factor to only touch two neighboring states, and any of the calibration.
+   * @return False if the graph does not have this structure (nothing will have been changed)
+   */
+  bool optimize_problem_arrowhead();
+
+  /**
+   * @brief Our Levenberg-Marquardt loop, which linearizes and evaluates the error of the graph in parallel.
+   *
+   * The linear solver is given as two functions, so we can use either gtsam's elimination or our own solver.
+   * This has the same damping schedule and stopping criteria as gtsam's optimizer, along with our convergence monitor.
+   *
+   * @param name Name of the linear solver (for printing)
+   * @param set_system Called with each new linearization of the graph, false if the solver can not handle it
+   * @param solve_step Solves for the update with a given damping, false if it failed (the damping will be increased)
+   * @return False if set_system failed (nothing will have been changed)
+   */
+  bool optimize_problem_lm(const std::string &name, const std::function<bool(const gtsam::GaussianFactorGraph::shared_ptr &)> &set_system,
+                           const std::function<bool(double, gtsam::VectorValues &)> &solve_step);
+
+  /**
+   * @brief This will optimize the graph incrementally.
+   *
+   * Uses ISAM2 and adds the states and factors in chunks of time, so intermediate solutions can be published.
+   * If a lag is specified, states older than it will be marginalized out and their estimate fixed.
+   * Factors are added to the chunk of their newest state, while the calibration is added with the first chunk.
+   * The full graph is never built, each chunk's factors are created once it is reached and then only held by ISAM2.
+   * Thus with a lag the memory of the factors and preintegrations is bounded, while the state estimates are still kept for the output.
+   */
+  void optimize_problem_isam2();
+
+  /**
+   * @brief This will optimize the graph as a set of overlapping segments of time.
+   *
+   * Each segment is its own Levenberg-Marquardt problem with a prior on the calibration, and are solved in parallel.
+   * After each pass the calibration estimates of all segments are averaged, and become the prior for the next pass.
+   * A final pass holds the calibration at this average, so the states we save agree with the calibration we save.
+   * The states are then stitched together by blending the segment estimates over their overlaps.
+   * Neighboring segments always share at least one state, so every factor is in some segment.
+   */
+  void optimize_problem_segments();
+
+  // Timing of each phase
+  std::shared_ptr<Profiler> profiler;
+
+  // Change of our estimate each iteration, and if we can stop early
+  std::shared_ptr<ConvergenceMonitor> monitor;
 
   // ROS node handler
   ros::NodeHandle nh;
@@ -154,14 +315,67 @@ protected:
   // Optimized values
   gtsam::Values values_result;
 
+  // State IDs our graph was built with, and the index of the IMU factor of each interval in it
+  // If the states are the same when we relinearize, we keep the graph and only replace IMU factors
+  std::vector<size_t> graph_state_ids;
+  std::vector<size_t> imu_factor_idx;
+
+  // Elimination ordering of the graph (empty if it needs to be computed), and the LM damping we finished with
+  // These let us warm start the next optimization when we relinearize
+  gtsam::Ordering graph_ordering;
+  double last_lambda = -1;
+
   // Config for what we are optimizing
   std::shared_ptr<GtsamConfig> config;
 
-  // Map between state timestamp and their IDs
-  std::map<double, size_t> map_states;
+  // Decides which state times are valid, and the ones we have removed
+  std::shared_ptr<StateGridPlanner> planner;
+  std::vector<DroppedRange> dropped_states;
+
+  // ID of each state, in the same order as timestamp_cameras (thus IDs are increasing)
+  // A state's node in the graph is X(id), so we never need to look up a state by its timestamp
+  std::vector<size_t> state_ids;
+
+  // Preintegration starting at each state ID, and the ID of the state it ends at (number of IDs if we have none)
+  std::vector<CpiV1, Eigen::aligned_allocator<CpiV1>> preint_cache;
+  std::vector<size_t> preint_cache_end;
 
   // Number of times we will loop and relinearize the measurements
+  // We only integrate an interval again if its bias moved more than these from its linearization point (rad/s and m/s^2)
   int num_loop_relin;
+  double relin_bias_thresh_gyro;
+  double relin_bias_thresh_accel;
+
+  // Number of threads we will use for our parallel stages
+  int num_threads;
+
+  // Elimination ordering we will use for the batch optimization (chain or metis)
+  std::string ordering_type;
+
+  // If we should solve our batch steps with our block-tridiagonal solver instead of gtsam's elimination
+  bool use_arrowhead_solver;
+
+  // If we should save the marginal covariances of the states and calibration
+  bool export_covariance;
+
+  // If we should also save the states to a binary file
+  bool save_binary;
+
+  // Rate we will output our trajectory at (zero or negative to only output our states)
+  double output_freq;
+
+  // If we should solve incrementally with ISAM2 (chunk size and marginalization lag in seconds)
+  bool use_isam2;
+  double isam2_chunk_sec;
+  double isam2_lag_sec;
+
+  // If we should solve in overlapping segments of time (length, overlap, and calibration consensus passes)
+  // Prior sigmas are on the calibration of each segment (ori, pos, grav, toff)
+  bool use_segments;
+  double segment_sec;
+  double segment_overlap_sec;
+  int segment_num_consensus;
+  std::vector<double> segment_prior_sigmas;
 
   // Small dt we will perturb to do our time derivative of
   double TIME_OFFSET = 0.25;
@@ -0,0 +1,87 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Gets the number of worker threads we should use.
+ * @param num_threads Requested number of threads (zero or negative will use all hardware threads)
+ * @return Number of threads which is at least one
+ */
+inline int get_num_threads(int num_threads) {
+  if (num_threads > 0)
+    return num_threads;
+  return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+/**
+ * @brief Calls the function on each index in [0, num_items) using a set of worker threads.
+ *
+ * Indices are handed out in small contiguous blocks, and each index is processed exactly once.
+ * If the function only writes to outputs owned by its index, the result does not depend on the number of threads.
+ * With a single thread (or a single item) this will just run serially on the calling thread.
+ *
+ * @param num_items Number of indices to process
+ * @param num_threads Number of threads to use (zero or negative will use all hardware threads)
+ * @param func Function which takes a size_t index
+ */
+template <typename Func> void parallel_for(size_t num_items, int num_threads, const Func &func) {
+
+  // Serial path, nothing to split
+  size_t threads = std::min((size_t)get_num_threads(num_threads), num_items);
+  if (threads <= 1) {
+    for (size_t i = 0; i < num_items; i++) {
+      func(i);
+    }
+    return;
+  }
+
+  // Each worker grabs the next block of indices until we run out
+  size_t block = std::max((size_t)1, num_items / (8 * threads));
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    while (true) {
+      size_t start = next.fetch_add(block);
+      if (start >= num_items)
+        break;
+      size_t end = std::min(start + block, num_items);
+      for (size_t i = start; i < end; i++) {
+        func(i);
+      }
+    }
+  };
+
+  // Launch our workers, and have the calling thread help out
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; t++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+}
+
+#endif // PARALLEL_H
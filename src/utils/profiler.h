@@ -0,0 +1,125 @@
+/*
+ * The vicon2gt project
+ * Copyright (C) 2020 Patrick Geneva
+ * Copyright (C) 2020 Guoquan Huang
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Records how long each phase of our pipeline takes.
+ *
+ * Each phase can be recorded many times (e.g. once per optimization iteration), and we report the count, total, and percentiles.
+ * This is safe to record into from multiple threads at once.
+ */
+class Profiler {
+
+public:
+  /**
+   * @brief Timer which records a phase when it goes out of scope.
+   *
+   * If the profiler is null, then this does nothing, thus the profiler can be optional.
+   */
+  class Scope {
+  public:
+    /// Starts timing the phase
+    Scope(const std::shared_ptr<Profiler> &profiler, std::string phase)
+        : profiler(profiler.get()), phase(phase), time_start(std::chrono::steady_clock::now()) {}
+
+    /// Records the phase if we have not already
+    ~Scope() { stop(); }
+
+    /// Records the phase, and returns how long it took in seconds
+    double stop() {
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+      if (profiler != nullptr)
+        profiler->record(phase, seconds);
+      profiler = nullptr;
+      return seconds;
+    }
+
+  private:
+    Profiler *profiler;
+    std::string phase;
+    std::chrono::steady_clock::time_point time_start;
+  };
+
+  /**
+   * @brief Records a single sample of a phase
+   * @param phase Name of the phase
+   * @param seconds How long it took
+   */
+  void record(const std::string &phase, double seconds) {
+    std::lock_guard<std::mutex> lck(mtx);
+    if (samples.find(phase) == samples.end())
+      phases.push_back(phase);
+    samples[phase].push_back(seconds);
+  }
+
+  /**
+   * @brief Writes all phases to a json file
+   *
+   * Phases are written in the order they were first recorded.
+   * All times are in seconds, and percentiles use the nearest rank.
+   *
+   * @param path Path to the file we will write
+   * @return True if we were able to write the file
+   */
+  bool write_json(const std::string &path) const {
+    std::lock_guard<std::mutex> lck(mtx);
+    FILE *file = std::fopen(path.c_str(), "w");
+    if (file == nullptr)
+      return false;
+    std::fprintf(file, "{\n  \"phases\": [\n");
+    for (size_t i = 0; i < phases.size(); i++) {
+      std::vector<double> values = samples.at(phases.at(i));
+      std::sort(values.begin(), values.end());
+      double total = 0.0;
+      for (const double &value : values)
+        total += value;
+      std::fprintf(file, "    {\"name\": \"%s\", \"count\": %zu, \"total\": %.9f, \"mean\": %.9f, \"min\": %.9f, \"max\": %.9f, ",
+                   phases.at(i).c_str(), values.size(), total, total / values.size(), values.front(), values.back());
+      std::fprintf(file, "\"p50\": %.9f, \"p90\": %.9f, \"p99\": %.9f}%s\n", percentile(values, 50), percentile(values, 90),
+                   percentile(values, 99), (i + 1 < phases.size()) ? "," : "");
+    }
+    std::fprintf(file, "  ]\n}\n");
+    return std::fclose(file) == 0;
+  }
+
+private:
+  /// Nearest rank percentile of sorted values
+  static double percentile(const std::vector<double> &values_sorted, double percent) {
+    size_t rank = (size_t)std::ceil(percent / 100.0 * values_sorted.size());
+    return values_sorted.at(std::min(std::max(rank, (size_t)1), values_sorted.size()) - 1);
+  }
+
+  // Samples of each phase, and the order we first saw them in
+  mutable std::mutex mtx;
+  std::map<std::string, std::vector<double>> samples;
+  std::vector<std::string> phases;
+};
+
+#endif // PROFILER_H
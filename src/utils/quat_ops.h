@@ -151,9 +151,9 @@ inline Eigen::Matrix3d skew_x(const Eigen::Vector3d &w) {
  * @return 3x3 SO(3) rotation matrix
  */
 inline Eigen::Matrix3d quat_2_Rot(const Eigen::Vector4d &q) {
-  Eigen::Matrix3d q_x = skew_x(q.block(0, 0, 3, 1));
-  Eigen::MatrixXd Rot = (2 * std::pow(q(3, 0), 2) - 1) * Eigen::MatrixXd::Identity(3, 3) - 2 * q(3, 0) * q_x +
-                        2 * q.block(0, 0, 3, 1) * (q.block(0, 0, 3, 1).transpose());
+  Eigen::Matrix3d q_x = skew_x(q.block<3, 1>(0, 0));
+  Eigen::Matrix3d Rot = (2 * std::pow(q(3, 0), 2) - 1) * Eigen::Matrix3d::Identity() - 2 * q(3, 0) * q_x +
+                        2 * q.block<3, 1>(0, 0) * (q.block<3, 1>(0, 0).transpose());
   return Rot;
 }
 
@@ -182,7 +182,7 @@ inline Eigen::Vector4d quat_multiply(const Eigen::Vector4d &q, const Eigen::Vect
   Eigen::Vector4d q_t;
   Eigen::Matrix4d Qm;
   // create big L matrix
-  Qm.block(0, 0, 3, 3) = q(3, 0) * Eigen::MatrixXd::Identity(3, 3) - skew_x(q.block(0, 0, 3, 1));
+  Qm.block(0, 0, 3, 3) = q(3, 0) * Eigen::Matrix3d::Identity() - skew_x(q.block(0, 0, 3, 1));
   Qm.block(0, 3, 3, 1) = q.block(0, 0, 3, 1);
   Qm.block(3, 0, 1, 3) = -q.block(0, 0, 3, 1).transpose();
   Qm(3, 3) = q(3, 0);
@@ -245,9 +245,9 @@ inline Eigen::Matrix3d exp_so3(const Eigen::Vector3d &w) {
   // compute so(3) rotation
   Eigen::Matrix3d R;
   if (theta == 0) {
-    R = Eigen::MatrixXd::Identity(3, 3);
+    R = Eigen::Matrix3d::Identity();
   } else {
-    R = Eigen::MatrixXd::Identity(3, 3) + A * w_x + B * w_x * w_x;
+    R = Eigen::Matrix3d::Identity() + A * w_x + B * w_x * w_x;
   }
   return R;
 }
@@ -279,7 +279,7 @@ inline Eigen::Vector3d log_so3(const Eigen::Matrix3d &R) {
   // calculate the skew symetric matrix
   Eigen::Matrix3d w_x = D * (R - R.transpose());
   // check if we are near the identity
-  if (R != Eigen::MatrixXd::Identity(3, 3)) {
+  if (R != Eigen::Matrix3d::Identity()) {
     Eigen::Vector3d vec;
     vec << w_x(2, 1), w_x(0, 2), w_x(1, 0);
     return vec;
@@ -492,10 +492,10 @@ inline Eigen::Vector4d quatnorm(Eigen::Vector4d q_t) {
 inline Eigen::Matrix3d Jl_so3(Eigen::Vector3d w) {
   double theta = w.norm();
   if (theta < 1e-12) {
-    return Eigen::MatrixXd::Identity(3, 3);
+    return Eigen::Matrix3d::Identity();
   } else {
     Eigen::Vector3d a = w / theta;
-    Eigen::Matrix3d J = sin(theta) / theta * Eigen::MatrixXd::Identity(3, 3) + (1 - sin(theta) / theta) * a * a.transpose() +
+    Eigen::Matrix3d J = sin(theta) / theta * Eigen::Matrix3d::Identity() + (1 - sin(theta) / theta) * a * a.transpose() +
                         ((1 - cos(theta)) / theta) * skew_x(a);
     return J;
   }